@@ -0,0 +1,407 @@
+/***************************************************************************
+ *  include/color_classification/classification_engine.h
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_COLORCLASSIFICATION_CLASSIFICATIONENGINE
+#define USCAUV_COLORCLASSIFICATION_CLASSIFICATIONENGINE
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+/// uscauv
+#include <uscauv_common/thread_pool.h>
+
+/// color_classification
+#include <color_classification/color_table.h>
+#include <color_classification/svm_batch_predictor.h>
+
+/// cpp11
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace uscauv
+{
+
+  /**
+   * How a single color is classified. Colors with a table are looked up by (H,S); colors that can't be
+   * tabulated (e.g. because they also depend on V) are evaluated directly by an SVMBatchPredictor.
+   */
+  struct ColorBackend
+  {
+    cv::Mat table_;
+    std::shared_ptr<SVMBatchPredictor const> predictor_;
+
+    ColorBackend() {}
+    ColorBackend( cv::Mat const & table ): table_( table ) {}
+    ColorBackend( std::shared_ptr<SVMBatchPredictor const> const & predictor ): predictor_( predictor ) {}
+
+    bool isTable() const { return !table_.empty(); }
+
+    /** 
+     * Classify an HSV image
+     * 
+     * @param hsv CV_8UC3 HSV image
+     * @param output CV_8UC1 image that is 255 where the color is present and 0 elsewhere
+     */
+    void apply( cv::Mat const & hsv, cv::Mat & output ) const
+    {
+      if( isTable() )
+	applyColorTable( hsv, table_, output );
+      else
+	predictor_->classify( hsv, output );
+    }
+  };
+
+  /// Everything needed to classify all colors into an encoded image in one pass
+  struct EncodedModel
+  {
+    /// Combined table, see compileEncodedTable(). Composites of table colors are folded into it.
+    cv::Mat table_;
+    /// Backend for each base color bit. Colors without a table are evaluated per tile.
+    std::vector<ColorBackend> colors_;
+    /// (source bits, composite bit) for composites that include colors without a table. Resolved per tile.
+    std::vector<std::pair<uint64_t, unsigned int> > composites_;
+
+    /** 
+     * @param colors Backend for each base color, in bit order
+     * @param composites (source bits, composite bit) for each composite color. Composite bits come after the base colors.
+     * @param plane_bits Width of the encoded image
+     */
+    void compile( std::vector<ColorBackend> const & colors, std::vector<std::pair<uint64_t, unsigned int> > const & composites,
+		  unsigned int const plane_bits )
+    {
+      colors_ = colors;
+      composites_.clear();
+
+      uint64_t table_bits = 0;
+      std::vector<cv::Mat> tables;
+      for( size_t color = 0; color < colors_.size(); ++color )
+	{
+	  tables.push_back( colors_[ color ].table_ );
+	  if( colors_[ color ].isTable() )
+	    table_bits |= uint64_t( 1 ) << color;
+	}
+      
+      compileEncodedTable( tables, table_, plane_bits );
+
+      /// A composite of table colors is a pure function of (H,S) too, so it costs nothing at runtime
+      for( std::pair<uint64_t, unsigned int> const & composite : composites )
+	{
+	  if( ( composite.first & table_bits ) == composite.first )
+	    orCompositeBit( table_, composite.first, composite.second );
+	  else
+	    composites_.push_back( composite );
+	}
+    }
+  };
+
+  /// What coarse-to-fine classification actually did for a frame
+  struct CoarseToFineStats
+  {
+    /// Pixels of the downsampled image, and how many of them matched any color
+    size_t coarse_pixels_, coarse_hits_;
+    /// Full resolution pixels that were classified
+    size_t fine_pixels_;
+    size_t regions_;
+  };
+
+  /**
+   * Classifies images against a set of colors on a fixed pool of threads. Frames are split into
+   * tiles of tile_rows rows, and each (tile, color) pair is a separate work item, so the amount of
+   * parallelism depends on the frame size and the number of cores rather than on the number of colors.
+   */
+  class ColorClassificationEngine
+  {
+  private:
+    ThreadPool pool_;
+    int tile_rows_;
+    
+    cv::Mat hsv_;
+
+    /// coarse-to-fine buffers. The coarse pass has its own HSV buffer so that hsv_ keeps its full size.
+    cv::Mat coarse_bgr_, coarse_hsv_, coarse_encoded_, coarse_mask_;
+    std::vector<std::vector<cv::Point> > coarse_contours_;
+    std::vector<cv::Rect> regions_;
+
+    /// incremental classification. Each tile holds the frame that it was last classified in.
+    cv::Mat reference_;
+
+    /// Convert one tile to HSV and classify it against every color. Runs on the pool.
+    static void classifyEncodedTile( cv::Mat const & bgr_tile, EncodedModel const & model, cv::Mat & hsv_tile, cv::Mat & encoded_tile )
+    {
+      cv::cvtColor( bgr_tile, hsv_tile, CV_BGR2HSV );
+      applyEncodedTable( hsv_tile, model.table_, encoded_tile );
+      
+      static thread_local cv::Mat mask;
+      for( size_t color = 0; color < model.colors_.size(); ++color )
+	{
+	  if( model.colors_[ color ].isTable() )
+	    continue;
+	  model.colors_[ color ].apply( hsv_tile, mask );
+	  orColorBit( mask, color, encoded_tile );
+	}
+
+      for( std::pair<uint64_t, unsigned int> const & composite : model.composites_ )
+	orCompositeBit( encoded_tile, composite.first, composite.second );
+    }
+
+    /// classifyEncoded() into a given HSV buffer
+    void classifyEncoded( cv::Mat const & bgr, EncodedModel const & model, cv::Mat & hsv, cv::Mat & encoded )
+    {
+      hsv.create( bgr.size(), CV_8UC3 );
+      encoded.create( bgr.size(), model.table_.type() );
+
+      pool_.run( tileCount( bgr.rows ), [&]( size_t const tile )
+		 {
+		   cv::Range const rows = tileRange( tile, bgr.rows );
+		   cv::Mat hsv_tile = hsv.rowRange( rows ), encoded_tile = encoded.rowRange( rows );
+		   classifyEncodedTile( bgr.rowRange( rows ), model, hsv_tile, encoded_tile );
+		 });
+    }
+
+  public:
+    /** 
+     * @param threads Number of threads to classify with. If 0, use one per hardware thread.
+     * @param tile_rows Number of image rows per work item
+     */
+    ColorClassificationEngine( unsigned int const threads = 0, int const tile_rows = 32 ):
+      pool_( threads ), tile_rows_( std::max( tile_rows, 1 ) )
+    {}
+
+    /// Number of threads used for classification
+    unsigned int threads() const { return pool_.size(); }
+    
+    int tileRows() const { return tile_rows_; }
+
+    int tileCount( int const rows ) const { return ( rows + tile_rows_ - 1 ) / tile_rows_; }
+
+    cv::Range tileRange( int const tile, int const rows ) const
+    {
+      return cv::Range( tile * tile_rows_, std::min( (tile + 1) * tile_rows_, rows ) );
+    }
+
+    /// HSV version of the last image that was classified
+    cv::Mat const & hsv() const { return hsv_; }
+    
+    /** 
+     * Classify a BGR image against each of a set of colors.
+     * 
+     * @param bgr CV_8UC3 BGR image
+     * @param colors Backend for each color
+     * @param outputs One CV_8UC1 image per color. Existing images of the correct size are reused.
+     */
+    void classify( cv::Mat const & bgr, std::vector<ColorBackend> const & colors, std::vector<cv::Mat> & outputs )
+    {
+      int const tile_count = tileCount( bgr.rows );
+      size_t const color_count = colors.size();
+      
+      hsv_.create( bgr.size(), CV_8UC3 );
+      outputs.resize( color_count );
+      for( cv::Mat & output : outputs )
+	output.create( bgr.size(), CV_8UC1 );
+
+      pool_.run( tile_count, [&]( size_t const tile )
+		 {
+		   cv::Range const rows = tileRange( tile, bgr.rows );
+		   cv::Mat hsv_tile = hsv_.rowRange( rows );
+		   cv::cvtColor( bgr.rowRange( rows ), hsv_tile, CV_BGR2HSV );
+		 });
+      
+      /// Consecutive items share a tile, so that a thread working through its own queue keeps the tile in cache
+      pool_.run( tile_count * color_count, [&]( size_t const item )
+		 {
+		   size_t const color = item % color_count;
+		   cv::Range const rows = tileRange( item / color_count, bgr.rows );
+		   cv::Mat output_tile = outputs[ color ].rowRange( rows );
+		   colors[ color ].apply( hsv_.rowRange( rows ), output_tile );
+		 });
+    }
+
+    /** 
+     * Classify a BGR image against all colors at once using a combined table. Each tile is converted
+     * to HSV and looked up by the same work item. Colors without a table, and the composites that
+     * depend on them, are evaluated on the same tile and or'd into their bits.
+     * 
+     * @param bgr CV_8UC3 BGR image
+     * @param model Compiled model
+     * @param encoded Encoded image with the same type as the model's table. Reused if it already has the correct size and type.
+     */
+    void classifyEncoded( cv::Mat const & bgr, EncodedModel const & model, cv::Mat & encoded )
+    {
+      classifyEncoded( bgr, model, hsv_, encoded );
+    }
+
+    /** 
+     * Classify only the tiles of a BGR image that changed since they were last classified, and leave the rest of
+     * the encoded image as it was. A tile has changed if its mean absolute difference from the frame that it was
+     * last classified in exceeds threshold. Comparing against that frame rather than the previous one means that
+     * slow changes still add up to a reclassification.
+     * 
+     * @param bgr CV_8UC3 BGR image
+     * @param model Compiled model
+     * @param threshold Mean absolute difference per channel (0-255) above which a tile is reclassified
+     * @param full Reclassify every tile, e.g. to bound drift
+     * @param encoded Encoded image from the previous call. Every tile is classified if it has the wrong size or type.
+     * 
+     * @return Number of tiles that were classified
+     */
+    size_t classifyIncremental( cv::Mat const & bgr, EncodedModel const & model, double const threshold, bool full, cv::Mat & encoded )
+    {
+      if( reference_.size() != bgr.size() || encoded.size() != bgr.size() || encoded.type() != model.table_.type() )
+	full = true;
+      
+      hsv_.create( bgr.size(), CV_8UC3 );
+      encoded.create( bgr.size(), model.table_.type() );
+      reference_.create( bgr.size(), CV_8UC3 );
+
+      std::atomic<size_t> changed( 0 );
+      
+      pool_.run( tileCount( bgr.rows ), [&]( size_t const tile )
+		 {
+		   cv::Range const rows = tileRange( tile, bgr.rows );
+		   cv::Mat const bgr_tile = bgr.rowRange( rows );
+		   cv::Mat reference_tile = reference_.rowRange( rows );
+		   
+		   if( !full && cv::norm( bgr_tile, reference_tile, cv::NORM_L1 ) <= threshold * bgr_tile.total() * 3 )
+		     return;
+		   
+		   cv::Mat hsv_tile = hsv_.rowRange( rows ), encoded_tile = encoded.rowRange( rows );
+		   classifyEncodedTile( bgr_tile, model, hsv_tile, encoded_tile );
+		   bgr_tile.copyTo( reference_tile );
+		   ++changed;
+		 });
+
+      return changed;
+    }
+
+    /** 
+     * Classify only the parts of a BGR image that are near a color at low resolution. The image is shrunk by
+     * factor and classified with classifyEncoded(), the hits are dilated by margin coarse pixels, and the full
+     * resolution image is then classified with classifyEncoded() inside the bounding box of each dilated blob.
+     * Everything outside of the boxes is 0. Objects that are too small to survive downsampling are missed.
+     * 
+     * @param bgr CV_8UC3 BGR image
+     * @param model Compiled model
+     * @param factor Downsampling factor
+     * @param margin Dilation radius, in coarse pixels
+     * @param encoded Encoded image with the same type as the model's table. Reused if it already has the correct size and type.
+     * 
+     * @return What was classified
+     */
+    CoarseToFineStats classifyCoarseToFine( cv::Mat const & bgr, EncodedModel const & model, int const factor, int const margin,
+					    cv::Mat & encoded )
+    {
+      CoarseToFineStats stats = CoarseToFineStats();
+      
+      cv::Size const coarse_size( ( bgr.cols + factor - 1 ) / factor, ( bgr.rows + factor - 1 ) / factor );
+      cv::resize( bgr, coarse_bgr_, coarse_size, 0, 0, cv::INTER_AREA );
+      
+      classifyEncoded( coarse_bgr_, model, coarse_hsv_, coarse_encoded_ );
+
+      colorPlaneMask( coarse_encoded_, coarse_mask_ );
+      stats.coarse_pixels_ = coarse_mask_.total();
+      stats.coarse_hits_ = cv::countNonZero( coarse_mask_ );
+
+      encoded.create( bgr.size(), model.table_.type() );
+      encoded.setTo( 0 );
+      hsv_.create( bgr.size(), CV_8UC3 );
+
+      if( !stats.coarse_hits_ )
+	return stats;
+      
+      if( margin > 0 )
+	cv::dilate( coarse_mask_, coarse_mask_, cv::getStructuringElement( cv::MORPH_RECT, cv::Size( 2 * margin + 1, 2 * margin + 1 ) ) );
+
+      coarse_contours_.clear();
+      cv::findContours( coarse_mask_, coarse_contours_, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE );
+
+      /// Scale each box back up to full resolution, rounding outwards
+      double const scale_x = double( bgr.cols ) / coarse_size.width, scale_y = double( bgr.rows ) / coarse_size.height;
+      cv::Rect const image_rect( 0, 0, bgr.cols, bgr.rows );
+      
+      regions_.clear();
+      for( std::vector<cv::Point> const & contour : coarse_contours_ )
+	{
+	  cv::Rect const box = cv::boundingRect( contour );
+	  int const x0 = std::floor( box.x * scale_x ), y0 = std::floor( box.y * scale_y );
+	  int const x1 = std::ceil( ( box.x + box.width ) * scale_x ), y1 = std::ceil( ( box.y + box.height ) * scale_y );
+	  regions_.push_back( cv::Rect( x0, y0, x1 - x0, y1 - y0 ) & image_rect );
+	}
+
+      /// Bounding boxes of separate blobs can still overlap. Merge them so that no pixel is classified twice.
+      for( bool merged = true; merged; )
+	{
+	  merged = false;
+	  for( size_t first = 0; first < regions_.size() && !merged; ++first )
+	    for( size_t second = first + 1; second < regions_.size() && !merged; ++second )
+	      if( ( regions_[ first ] & regions_[ second ] ).area() )
+		{
+		  regions_[ first ] |= regions_[ second ];
+		  regions_.erase( regions_.begin() + second );
+		  merged = true;
+		}
+	}
+      
+      /// One work item per tile of each region
+      std::vector<std::pair<size_t, cv::Range> > items;
+      for( size_t region = 0; region < regions_.size(); ++region )
+	{
+	  cv::Rect const & rect = regions_[ region ];
+	  stats.fine_pixels_ += rect.area();
+	  for( int tile = 0; tile < tileCount( rect.height ); ++tile )
+	    {
+	      cv::Range const rows = tileRange( tile, rect.height );
+	      items.push_back( std::make_pair( region, cv::Range( rect.y + rows.start, rect.y + rows.end ) ) );
+	    }
+	}
+      stats.regions_ = regions_.size();
+
+      pool_.run( items.size(), [&]( size_t const item )
+		 {
+		   cv::Rect const & rect = regions_[ items[ item ].first ];
+		   cv::Range const rows = items[ item ].second, cols( rect.x, rect.x + rect.width );
+		   cv::Mat hsv_tile = hsv_( rows, cols ), encoded_tile = encoded( rows, cols );
+		   classifyEncodedTile( bgr( rows, cols ), model, hsv_tile, encoded_tile );
+		 });
+
+      return stats;
+    }
+  };
+
+} // uscauv
+
+#endif // USCAUV_COLORCLASSIFICATION_CLASSIFICATIONENGINE
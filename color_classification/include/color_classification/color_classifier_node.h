@@ -53,44 +53,67 @@
 #include <XmlRpcValue.h>
 
 /// cpp11
+#include <memory>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
-#include <functional>
 
 /// uscauv
 #include <uscauv_common/color_codec.h>
 #include <uscauv_common/param_loader.h>
 #include <uscauv_common/tic_toc.h>
+#include <uscauv_common/performance_stats.h>
+
+/// color_classification
+#include <color_classification/color_table.h>
+#include <color_classification/classification_engine.h>
+#include <color_classification/color_table_cache.h>
+#include <color_classification/svm_batch_predictor.h>
 
 std::string const COLOR_NS = "model/colors";
 std::string const COMPOSITES_NAME = "composites";
 std::string const COMPOSITES_NS = COLOR_NS + "/" + COMPOSITES_NAME;
+/// Change this whenever the way tables are compiled changes, so that old cache entries are not used
+std::string const COLOR_TABLE_CACHE_VERSION = "1";
 
 typedef std::map<std::string, image_transport::Publisher> _ColorPublisherMap;
 
-struct ClassifyThreadStorage
+struct ColorModel
 {
-  typedef std::shared_ptr<ClassifyThreadStorage> Ptr;
-  typedef std::shared_ptr<ClassifyThreadStorage const> ConstPtr;
+  typedef std::shared_ptr<ColorModel> Ptr;
+  typedef std::shared_ptr<ColorModel const> ConstPtr;
   
-  enum class State{ READY, PROCESSED };
-  State state_;
+  /// cv::SVM doesn't have proper copy assignment
+  uscauv::InspectableSVM svm_;
 
-  std::condition_variable cv_;
-  std::mutex m_;
+  /// svm_ evaluated over every 8-bit (H,S) pair, see uscauv::compileColorTable()
+  cv::Mat table_;
+  /// Set if table_ points into a memory-mapped cache entry
+  std::shared_ptr<void const> table_mapping_;
 
-  cv::Mat input_, output_;
+  /// Set instead of table_ if the SVM is evaluated directly
+  std::shared_ptr<uscauv::SVMBatchPredictor> predictor_;
 
-  /// cv::SVM doesn't have proper copy assignment
-  cv::SVM svm_;
-  
-  ClassifyThreadStorage(){ state_ = State::PROCESSED; }
+  uscauv::ColorBackend backend() const
+  {
+    return predictor_ ? uscauv::ColorBackend( predictor_ ) : uscauv::ColorBackend( table_ );
+  }
 };
 
-typedef std::map<std::string, ClassifyThreadStorage::Ptr > _ColorThreadMap;
+typedef std::map<std::string, ColorModel::Ptr > _ColorModelMap;
 typedef std::vector< std::string > _CompositeColor;
 typedef std::map<std::string, _CompositeColor> _CompositeColorMap;
+typedef std::map<std::string, uint64_t> _ColorBitMap;
+
+/// A frame that has been received and converted, waiting to be classified
+struct PendingFrame
+{
+  cv_bridge::CvImageConstPtr image_;
+  /// ROS time of arrival, to compare against the camera stamp
+  ros::Time arrival_;
+  /// wall time stage boundaries
+  ros::WallTime received_, converted_;
+};
 
 class ColorClassifierNode
 {
@@ -100,15 +123,60 @@ class ColorClassifierNode
   image_transport::ImageTransport image_transport_;
   image_transport::Subscriber image_sub_;
   _ColorPublisherMap classified_image_pub_;
-  _ColorThreadMap thread_storage_;
+  _ColorModelMap color_models_;
   _CompositeColorMap composite_colors_;
   uscauv::EncodedColorPublisher encoded_image_pub_;  
+  uscauv::PerformanceStatsPublisher stats_pub_;
 
   /// parameters
   double loop_rate_hz_;
+  /// classify all colors in one pass instead of one pass per color
+  bool fused_;
+  /// classification threads (0 for one per core) and rows per tile
+  int classify_threads_, tile_rows_;
+  /// classify on a separate thread while the next frame is received
+  bool pipelined_;
+  /// "table" to classify (H,S) models by table lookup, "svm" to always evaluate the SVMs directly
+  std::string backend_;
+  /// coarse-to-fine mode. Downsampling factor (<= 1 disables), configured and current dilation margin in coarse pixels,
+  /// fraction of pixels that may differ from a full resolution pass, and how often (in frames) to run one to check.
+  /// The tolerance is only checked on those frames, so frames in between may exceed it.
+  int coarse_factor_, coarse_base_margin_, coarse_margin_, coarse_verify_interval_;
+  double coarse_tolerance_;
+  /// incremental mode. Only tiles whose mean absolute difference exceeds incremental_threshold_ are
+  /// reclassified, and every tile is reclassified every incremental_refresh_ frames
+  bool incremental_;
+  double incremental_threshold_;
+  int incremental_refresh_;
+  /// run-length encode the encoded image before publishing it
+  bool compress_encoded_;
   
   /// color classification
-  std::vector<std::string> color_names_;
+  std::vector<std::string> color_names_; /// in the order that they appear in the encoded image
+  /// (bits of the base colors that make up the composite, bit of the composite) for each composite color, in bit order
+  std::vector<std::pair<uint64_t, unsigned int> > composites_;
+  unsigned int plane_bits_; /// width of the encoded image
+
+  /// classification
+  std::shared_ptr<uscauv::ColorClassificationEngine> engine_;
+  std::vector<uscauv::ColorBackend> color_backends_; /// in the same order as color_models_
+  std::vector<cv::Mat> classified_images_;
+  uscauv::EncodedModel encoded_model_;
+  uscauv::ColorTableCache table_cache_;
+
+  /// Reused between frames so that steady-state classification doesn't allocate
+  cv::Mat encoded_image_, debug_image_;
+  cv::Mat verify_image_, mismatch_plane_, mismatch_mask_;
+  unsigned int coarse_frames_, incremental_frames_;
+  uscauv::ColorEncoder encoder_;
+
+  /// pipelining. The image callback leaves at most one frame in pending_frame_; newer frames replace stale ones.
+  std::thread pipeline_thread_;
+  std::mutex pipeline_mutex_;
+  std::condition_variable pipeline_cv_;
+  PendingFrame pending_frame_;
+  unsigned int dropped_frames_;
+  bool stopping_;
   
  public:
 
@@ -119,83 +187,83 @@ class ColorClassifierNode
  ColorClassifierNode()
    :
   nh_rel_("~"),
-    image_transport_( nh_rel_ )
+    image_transport_( nh_rel_ ),
+    pipelined_( false ),
+    coarse_factor_( 0 ),
+    coarse_base_margin_( 0 ),
+    coarse_margin_( 0 ),
+    plane_bits_( 16 ),
+    coarse_frames_( 0 ),
+    incremental_frames_( 0 ),
+    dropped_frames_( 0 ),
+    stopping_( false )
     {}
-    
- private:
-    
-  /// Spawn one thread that runs this function per color definition
-  void classifyThread(ClassifyThreadStorage::Ptr storage)
-  {
-    while(true)
+
+  ~ColorClassifierNode()
+    {
       {
+	std::lock_guard<std::mutex> lock( pipeline_mutex_ );
+	stopping_ = true;
+      }
+      pipeline_cv_.notify_all();
       
-	/// Wait for the main thread to signal that the image is ready for processing
-	{
-	  std::unique_lock<std::mutex> lock( storage->m_ );
-	  storage->cv_.wait( lock, [&]{ return storage->state_ == ClassifyThreadStorage::State::READY; });
-	}
-	  
-	unsigned int match_count = 0;
-
-	cv::Mat input_image = storage->input_;
-
-	/// convert to HSV
-	cv::cvtColor(input_image, input_image, CV_BGR2HSV);
-    
-	cv::Mat input_hs( input_image.rows, input_image.cols, CV_8UC2 ), input_v( input_image.rows, input_image.cols, CV_8UC1 );
-	cv::Mat mix_out[] { input_hs, input_v };
-	int from_to[] = { 0,0, 1,1, 2,2 };
-	cv::mixChannels( &input_image, 1, mix_out, 2, from_to, 3);
+      if( pipeline_thread_.joinable() )
+	pipeline_thread_.join();
+    }
     
-	cv::Mat input_float;
-	input_hs.convertTo( input_float, CV_32F );
-    
-	cv::Mat classified_image = cv::Mat( input_image.size(), CV_8UC1 );
+ private:
     
-	/// Classify the input image.
-	cv::MatIterator_<unsigned char> cl_it = classified_image.begin<unsigned char>();
-	cv::MatConstIterator_<cv::Vec2f> in_it = input_float.begin<cv::Vec2f>();
-  
-	for(; in_it != input_float.end<cv::Vec2f>(); ++in_it, ++cl_it)
-	  {
-	    float response = storage->svm_.predict( cv::Mat(*in_it) );
-	      
-	    if ( response == -1.0)
-	      *cl_it = 0;
-	    else if ( response == 1.0 )
-	      {
-		*cl_it = 255;
-		++match_count;
-	      }
-	    else
-	      {
-		ROS_WARN( "SVM has incorrect output format. Image will not be classifed. Valid output: {-1, 1}");
-		/* return -1; */
-	      }
-	  }
-
-	storage->output_ = classified_image;
-	  
-	/* ROS_DEBUG("[ %s ] SVM matched %d pixels. ", color_name.c_str(),match_count); */
-	  
-	/// Notify the main thread that processing is complete
-	{
-	  std::lock_guard<std::mutex> lock( storage->m_ );
-	  storage->state_ = ClassifyThreadStorage::State::PROCESSED;
-	}
-	storage->cv_.notify_one();
-
-      }
-    return;
-  }
-  
   /// Running spin() will cause this function to be called before the node begins looping the spingOnce() function.
   void spinFirst()
   {
     /// Get ROS ready ------------------------------------
     ros::NodeHandle nh;
     image_transport_ = image_transport::ImageTransport( nh_rel_ );
+
+    fused_ = uscauv::param::load<bool>( nh_rel_, "fused", true );
+    classify_threads_ = uscauv::param::load<int>( nh_rel_, "threads", 0 );
+    tile_rows_ = uscauv::param::load<int>( nh_rel_, "tile_rows", 32 );
+    pipelined_ = uscauv::param::load<bool>( nh_rel_, "pipelined", false );
+    backend_ = uscauv::param::load<std::string>( nh_rel_, "backend", "table" );
+    if( backend_ != "table" && backend_ != "svm" )
+      {
+	ROS_WARN( "Unknown classification backend [ %s ]. Using [ table ].", backend_.c_str() );
+	backend_ = "table";
+      }
+
+    /// Compiled tables are cached under ROS_HOME by default. Set to "" to disable the cache.
+    char const * ros_home = getenv( "ROS_HOME" ), * home = getenv( "HOME" );
+    std::string const default_cache_dir = ros_home ? std::string( ros_home ) + "/color_classification" :
+      home ? std::string( home ) + "/.ros/color_classification" : "";
+    table_cache_ = uscauv::ColorTableCache( uscauv::param::load<std::string>( nh_rel_, "table_cache", default_cache_dir ) );
+
+    coarse_factor_ = uscauv::param::load<int>( nh_rel_, "coarse_factor", 0 );
+    coarse_base_margin_ = uscauv::param::load<int>( nh_rel_, "coarse_margin", 1 );
+    coarse_margin_ = coarse_base_margin_;
+    coarse_tolerance_ = uscauv::param::load<double>( nh_rel_, "coarse_tolerance", 0.001 );
+    coarse_verify_interval_ = uscauv::param::load<int>( nh_rel_, "coarse_verify_interval", 30 );
+    incremental_ = uscauv::param::load<bool>( nh_rel_, "incremental", false );
+    incremental_threshold_ = uscauv::param::load<double>( nh_rel_, "incremental_threshold", 2.0 );
+    incremental_refresh_ = uscauv::param::load<int>( nh_rel_, "incremental_refresh", 30 );
+    if( incremental_ && coarse_factor_ > 1 )
+      {
+	ROS_WARN( "Incremental and coarse-to-fine classification can't be combined. Disabling incremental mode." );
+	incremental_ = false;
+      }
+    if( incremental_ && !fused_ )
+      {
+	ROS_WARN( "Incremental classification requires fused mode. Enabling fused mode." );
+	fused_ = true;
+      }
+    compress_encoded_ = uscauv::param::load<bool>( nh_rel_, "compress_encoded", false );
+    if( coarse_factor_ > 1 && !fused_ )
+      {
+	ROS_WARN( "Coarse-to-fine classification requires fused mode. Enabling fused mode." );
+	fused_ = true;
+      }
+
+    engine_ = std::make_shared<uscauv::ColorClassificationEngine>( std::max( classify_threads_, 0 ), tile_rows_ );
+    ROS_INFO( "Classifying with [ %u ] threads.", engine_->threads() );
     
     /// Load SVMs ------------------------------------
     XmlRpc::XmlRpcValue xml_colors = uscauv::param::load<XmlRpc::XmlRpcValue>( nh, COLOR_NS );
@@ -206,7 +274,7 @@ class ColorClassifierNode
 	if( color_it->first == COMPOSITES_NAME )
 	  continue;
 	
-	ClassifyThreadStorage::Ptr storage = std::make_shared<ClassifyThreadStorage>();
+	ColorModel::Ptr model = std::make_shared<ColorModel>();
 	
 	std::string color_name, color_path;
 	
@@ -225,36 +293,60 @@ class ColorClassifierNode
 	    continue;
 	  }
 		
-	/// File I/O datatypes
-	/* std::shared_ptr<cv::SVM> color_svm = std::make_shared<cv::SVM>(); */
-	CvFileStorage * svm_storage = NULL;
-	CvFileNode * svm_node =       NULL;
-	
-	/// Open file storage
-	svm_storage = cvOpenFileStorage(color_path.c_str(), NULL, CV_STORAGE_READ);
-	if (svm_storage == NULL)
+	/// Tables are cached by the contents of the SVM file, so an unchanged SVM never needs to be parsed again
+	uint64_t cache_key = 0;
+	bool const cacheable = table_cache_.enabled() && !uscauv::hashFile( color_path, cache_key );
+	cache_key = uscauv::hashString( color_name + "/" + COLOR_TABLE_CACHE_VERSION, cache_key );
+
+	if( backend_ == "table" && cacheable && !table_cache_.load( color_name, cache_key, model->table_, model->table_mapping_ ) &&
+	    model->table_.type() == CV_8UC1 && model->table_.rows == uscauv::COLOR_TABLE_DIM && model->table_.cols == uscauv::COLOR_TABLE_DIM )
 	  {
-	    ROS_WARN( "Failed to open SVM. [ %s ] [ %s ]", color_name.c_str(), color_path.c_str() );
-	    continue;
+	    ROS_INFO( "Loaded compiled color table from cache. [ %s ]", color_name.c_str() );
 	  }
-
-	/// Search for a yaml node with the name of the color from the highest level.
-	svm_node = cvGetFileNodeByName( svm_storage, NULL, color_name.c_str() );
-	if (svm_node == NULL)
+	else
 	  {
-	    ROS_WARN( "Failed to find SVM file node. [ %s ]", color_name.c_str() );
-	    continue;
+	    model->table_ = cv::Mat();
+	    model->table_mapping_.reset();
+	    
+	    if( loadSVM( color_name, color_path, model->svm_ ) )
+	      continue;
+
+	    int const var_count = model->svm_.get_var_count();
+	    if( var_count != 2 && var_count != 3 )
+	      {
+		ROS_WARN( "SVM has [ %d ] input variables, but only (H,S) and (H,S,V) are supported. Skipping... [ %s ]",
+			  var_count, color_name.c_str() );
+		continue;
+	      }
+
+	    /// Only (H,S) models can be tabulated. Anything else is evaluated a row at a time.
+	    if( backend_ == "svm" || var_count != 2 )
+	      {
+		model->predictor_ = std::make_shared<uscauv::SVMBatchPredictor>();
+		if( model->predictor_->init( model->svm_ ) )
+		  ROS_WARN( "SVM can't be evaluated in batches and will be evaluated one pixel at a time. [ %s ]", color_name.c_str() );
+		
+		ROS_INFO( "Evaluating SVM directly with [ %d ] input variables. [ %s ]", var_count, color_name.c_str() );
+	      }
+	    else
+	      {
+		/// Evaluate the SVM over every (H,S) pair so that classification is just a table lookup
+		int const invalid_count = uscauv::compileColorTable( model->svm_, model->table_ );
+		if( invalid_count )
+		  ROS_WARN( "SVM has incorrect output format for [ %d ] (H,S) pairs. These will not be classified. Valid output: {-1, 1} [ %s ]",
+			    invalid_count, color_name.c_str() );
+	      }
+
+	    if( cacheable && !model->predictor_ )
+	      {
+		if( table_cache_.store( color_name, cache_key, model->table_ ) )
+		  ROS_WARN( "Failed to write compiled color table to cache. [ %s ]", table_cache_.entryPath( color_name, cache_key ).c_str() );
+		else
+		  ROS_INFO( "Wrote compiled color table to cache. [ %s ]", table_cache_.entryPath( color_name, cache_key ).c_str() );
+	      }
 	  }
-	
-	/// populate the fields the the cv::SVM
-	storage->svm_.read( svm_storage, svm_node );
-	
-	cvReleaseFileStorage( &svm_storage );
 
-	thread_storage_[ color_name ] = storage;
-	std::thread classify_thread( &ColorClassifierNode::classifyThread, this, 
-				     thread_storage_[ color_name ] );
-	classify_thread.detach();
+	color_models_[ color_name ] = model;
 	
 	++color_count;
 	ROS_INFO( "Loaded SVM successfully. [ %s ]", color_name.c_str() );
@@ -291,7 +383,7 @@ class ColorClassifierNode
 	std::string bad_color;
 	for( _CompositeColor::value_type const & color : composite.second )
 	  {
-	    if( thread_storage_.find( color ) == thread_storage_.end() )
+	    if( color_models_.find( color ) == color_models_.end() )
 	      {
 		bad_color = color;
 		break;
@@ -309,9 +401,50 @@ class ColorClassifierNode
 
     composite_colors_ = verified_composite_colors;
 
+    /// Base colors take the low bits of the encoded image, followed by composites
+    _ColorBitMap color_bits;
+    for( _ColorModelMap::value_type const & color : color_models_ )
+      {
+	color_bits[ color.first ] = uint64_t( 1 ) << color_names_.size();
+	color_names_.push_back( color.first );
+	color_backends_.push_back( color.second->backend() );
+      }
+    for( _CompositeColorMap::value_type const & composite : composite_colors_ )
+      {
+	uint64_t bits = 0;
+	for( _CompositeColor::value_type const & color : composite.second )
+	  bits |= color_bits[ color ];
+	composites_.push_back( std::make_pair( bits, color_names_.size() ) );
+	color_names_.push_back( composite.first );
+      }
+
+    /// One bit per color and composite, in the narrowest plane that fits
+    plane_bits_ = uscauv::colorPlaneBits( color_names_.size() );
+    if( !plane_bits_ )
+      {
+	ROS_FATAL( "Loaded [ %lu ] colors and composites, but at most [ %u ] can be encoded.", color_names_.size(), uscauv::COLOR_PLANE_MAX_BITS );
+	ros::shutdown();
+	return;
+      }
+    encoder_.setPlaneBits( plane_bits_ );
+    ROS_INFO( "Encoding [ %lu ] colors and composites in [ %u ] bit planes.", color_names_.size(), plane_bits_ );
+
+    if( fused_ )
+      {
+	/// Colors without a table, and composites that include them, are filled in by the engine
+	encoded_model_.compile( color_backends_, composites_, plane_bits_ );
+	ROS_INFO( "Compiled fused color table with [ %lu ] colors and [ %lu ] composites, [ %lu ] of which are resolved per pixel.",
+		  color_backends_.size(), composites_.size(), encoded_model_.composites_.size() );
+      }
+
     // Start IO #######################################################
     
     encoded_image_pub_.advertise( nh_rel_, "encoded", 1 );
+    encoded_image_pub_.setCompression( compress_encoded_ );
+    stats_pub_.advertise( nh_rel_, "stats", 1 );
+
+    if( pipelined_ )
+      pipeline_thread_ = std::thread( &ColorClassifierNode::pipelineThread, this );
 	  
     image_sub_ = image_transport_.subscribe( "image_color", 1, &ColorClassifierNode::imageCallback, this);
 
@@ -325,6 +458,45 @@ class ColorClassifierNode
     return;
   }
 
+  /** 
+   * Load an SVM from a yaml file
+   * 
+   * @param color_name Name of the color, which is also the name of the top-level yaml node
+   * @param color_path Path to the yaml file
+   * @param svm Output SVM
+   * 
+   * @return 0 on success, -1 on failure
+   */
+  int loadSVM( std::string const & color_name, std::string const & color_path, cv::SVM & svm )
+  {
+    /// File I/O datatypes
+    CvFileStorage * svm_storage = NULL;
+    CvFileNode * svm_node =       NULL;
+	
+    /// Open file storage
+    svm_storage = cvOpenFileStorage(color_path.c_str(), NULL, CV_STORAGE_READ);
+    if (svm_storage == NULL)
+      {
+	ROS_WARN( "Failed to open SVM. [ %s ] [ %s ]", color_name.c_str(), color_path.c_str() );
+	return -1;
+      }
+
+    /// Search for a yaml node with the name of the color from the highest level.
+    svm_node = cvGetFileNodeByName( svm_storage, NULL, color_name.c_str() );
+    if (svm_node == NULL)
+      {
+	ROS_WARN( "Failed to find SVM file node. [ %s ]", color_name.c_str() );
+	cvReleaseFileStorage( &svm_storage );
+	return -1;
+      }
+	
+    /// populate the fields the the cv::SVM
+    svm.read( svm_storage, svm_node );
+	
+    cvReleaseFileStorage( &svm_storage );
+    return 0;
+  }
+
  public:
   
   void spin()
@@ -355,18 +527,21 @@ class ColorClassifierNode
  private:
 
   /** 
-   * For each color, classify the incoming image and publish the results
+   * Convert the incoming image and either classify it immediately or, in pipelined mode,
+   * hand it off to the pipeline thread.
    * 
    * @param msg Color Image
    */
   void imageCallback(const sensor_msgs::ImageConstPtr & msg)
   {
-    cv_bridge::CvImagePtr cv_ptr;
-    uscauv::ColorEncoder encoder;
+    PendingFrame frame;
+    frame.arrival_ = ros::Time::now();
+    frame.received_ = ros::WallTime::now();
 
     try
       {
-	cv_ptr = cv_bridge::toCvCopy(msg, sensor_msgs::image_encodings::BGR8);
+	/// Only copies if the image isn't already BGR8. Otherwise, every worker reads straight from the message buffer.
+	frame.image_ = cv_bridge::toCvShare(msg, sensor_msgs::image_encodings::BGR8);
       }
     catch (cv_bridge::Exception& e)
       {
@@ -374,69 +549,195 @@ class ColorClassifierNode
 	return;
       }
 
-    /* tic; */
-    
-    for( _ColorThreadMap::iterator thread_it = thread_storage_.begin(); thread_it != thread_storage_.end(); ++thread_it )
+    frame.converted_ = ros::WallTime::now();
+
+    if( !pipelined_ )
       {
+	processFrame( frame, 0 );
+	return;
+      }
+
+    /// Latest frame wins. If the pipeline thread hasn't picked up the last frame yet, it is stale by now.
+    {
+      std::lock_guard<std::mutex> lock( pipeline_mutex_ );
+      if( pending_frame_.image_ )
+	++dropped_frames_;
+      pending_frame_ = frame;
+    }
+    pipeline_cv_.notify_one();
+  }
 
-	ClassifyThreadStorage::Ptr storage = thread_it->second;
+  /// Classifies frames handed off by imageCallback() in pipelined mode
+  void pipelineThread()
+  {
+    while( true )
+      {
+	PendingFrame frame;
+	unsigned int dropped_frames;
 	
-	/// Copy image into buffer, signal thread to process
 	{
-	  std::lock_guard<std::mutex> lock( storage->m_ );
-	  cv_ptr->image.copyTo( storage->input_ );
-	  storage->state_ = ClassifyThreadStorage::State::READY;
+	  std::unique_lock<std::mutex> lock( pipeline_mutex_ );
+	  pipeline_cv_.wait( lock, [this]{ return stopping_ || pending_frame_.image_; } );
+
+	  if( stopping_ )
+	    return;
+
+	  frame = pending_frame_;
+	  pending_frame_ = PendingFrame();
+	  dropped_frames = dropped_frames_;
+	  dropped_frames_ = 0;
 	}
-	storage->cv_.notify_one();
+
+	processFrame( frame, dropped_frames );
       }
+  }
 
-    /// I wanted to play around with this
-    for( _ColorThreadMap::value_type & thread_it : thread_storage_ )
-      {	
+  /** 
+   * Classify a frame, publish the results, and publish stage latencies.
+   * 
+   * @param frame Converted frame
+   * @param dropped_frames Number of frames that were dropped since the last processed frame
+   */
+  void processFrame( PendingFrame const & frame, unsigned int const dropped_frames )
+  {
+    ros::WallTime const started = ros::WallTime::now();
+
+    if( fused_ )
+      classifyFused( frame.image_ );
+    else
+      classifySeparate( frame.image_ );
+
+    ros::WallTime const finished = ros::WallTime::now();
+    std_msgs::Header const & header = frame.image_->header;
+
+    stats_pub_.set( "dropped_frames", dropped_frames );
+    stats_pub_.set( "convert_ms", ( frame.converted_ - frame.received_ ).toSec() * 1000 );
+    stats_pub_.set( "queue_ms", ( started - frame.converted_ ).toSec() * 1000 );
+    stats_pub_.set( "classify_ms", ( finished - started ).toSec() * 1000 );
+    stats_pub_.set( "encoded_bytes", encoded_image_pub_.lastSentBytes() );
+    stats_pub_.set( "encoded_raw_bytes", encoded_image_pub_.lastRawBytes() );
+    /// Age of the frame relative to the camera stamp, from the moment it was received and after it was published
+    stats_pub_.set( "receive_lag_ms", ( frame.arrival_ - header.stamp ).toSec() * 1000 );
+    stats_pub_.set( "publish_lag_ms", ( ros::Time::now() - header.stamp ).toSec() * 1000 );
+    stats_pub_.publish( header );
+  }
 
-	ClassifyThreadStorage::Ptr storage = thread_it.second;
+  /** 
+   * For each color, classify the incoming image and publish the results
+   * 
+   * @param cv_ptr BGR image
+   */
+  void classifySeparate( cv_bridge::CvImageConstPtr const & cv_ptr )
+  {
+    /* tic; */
 
-	cv_bridge::CvImage classified_image( cv_ptr->header,
-    					     sensor_msgs::image_encodings::MONO8 );
+    engine_->classify( cv_ptr->image, color_backends_, classified_images_ );
 
-	/// Wait for thread to finish processing the image
-	{
-	  std::unique_lock<std::mutex> lock( storage->m_ );
-	  storage->cv_.wait( lock, [&]{return storage->state_ == ClassifyThreadStorage::State::PROCESSED;} );
-	  encoder.addImage( storage->output_, thread_it.first );
-	  classified_image.image = storage->output_;
-	}
+    encoder_.clear();
+
+    size_t color_idx = 0;
+    for( _ColorModelMap::value_type const & color : color_models_ )
+      {	
+	cv::Mat const & output = classified_images_[ color_idx++ ];
 	
-	classified_image_pub_[ thread_it.first ].publish ( classified_image.toImageMsg() );
+	encoder_.addImage( output, color.first );
+
+	cv_bridge::CvImage classified_image( cv_ptr->header,
+    					     sensor_msgs::image_encodings::MONO8, output );
+	classified_image_pub_[ color.first ].publish ( classified_image.toImageMsg() );
       }
 
     /// TODO: Publish debug images for composite colors
-    for( _CompositeColorMap::value_type const & composite : composite_colors_ )
+    for( std::pair<uint64_t, unsigned int> const & composite : composites_ )
+      encoder_.addComposite( composite.first, color_names_[ composite.second ] );
+    
+    /* toc_info_stream( std::chrono::milliseconds, "Classify all"); */
+    
+    encoded_image_pub_.publish( encoder_, cv_ptr->header );
+    return;
+  }
+
+  /** 
+   * Classify into encoded_image_ at full resolution only near coarse hits. Every coarse_verify_interval_ frames the
+   * frame is also classified at full resolution. If the two differ by more than coarse_tolerance_, the full result
+   * is published instead and the dilation margin is widened; otherwise the margin shrinks back toward coarse_margin.
+   *
+   * The tolerance is sampled, not guaranteed: up to coarse_verify_interval_ - 1 unverified frames between two
+   * checks can differ from a full resolution pass by more than coarse_tolerance_.
+   * 
+   * @param bgr BGR image
+   */
+  void classifyCoarseToFine( cv::Mat const & bgr )
+  {
+    uscauv::CoarseToFineStats const coarse = engine_->classifyCoarseToFine( bgr, encoded_model_, coarse_factor_, coarse_margin_,
+									     encoded_image_ );
+
+    stats_pub_.set( "coarse_hit_rate", double( coarse.coarse_hits_ ) / coarse.coarse_pixels_ );
+    stats_pub_.set( "coarse_regions", coarse.regions_ );
+    stats_pub_.set( "pixels_processed", coarse.fine_pixels_ );
+    stats_pub_.set( "processed_ratio", double( coarse.fine_pixels_ ) / bgr.total() );
+
+    if( coarse_verify_interval_ <= 0 || ++coarse_frames_ % coarse_verify_interval_ )
+      return;
+    
+    engine_->classifyEncoded( bgr, encoded_model_, verify_image_ );
+    cv::bitwise_xor( verify_image_, encoded_image_, mismatch_plane_ );
+    uscauv::colorPlaneMask( mismatch_plane_, mismatch_mask_ );
+    double const mismatch = double( cv::countNonZero( mismatch_mask_ ) ) / bgr.total();
+    stats_pub_.set( "coarse_mismatch", mismatch );
+
+    if( mismatch > coarse_tolerance_ )
+      {
+	++coarse_margin_;
+	ROS_WARN( "Coarse-to-fine result differs from full resolution in [ %.4f ] of pixels (tolerance [ %.4f ]). Increasing margin to [ %d ].",
+		  mismatch, coarse_tolerance_, coarse_margin_ );
+	cv::swap( encoded_image_, verify_image_ );
+      }
+    /// The scene may have calmed down since the margin was widened
+    else if( coarse_margin_ > coarse_base_margin_ )
+      --coarse_margin_;
+  }
+
+  /** 
+   * Classify every color in a single pass over the image using the combined table
+   * and publish the result without re-encoding it.
+   * 
+   * @param cv_ptr BGR image
+   */
+  void classifyFused( cv_bridge::CvImageConstPtr const & cv_ptr )
+  {
+    if( coarse_factor_ > 1 )
+      classifyCoarseToFine( cv_ptr->image );
+    else if( incremental_ )
       {
-	cv::Mat composite_image;
+	/// Unchanged tiles keep their bits from the last frame that classified them, composite bits included
+	bool const full = incremental_refresh_ <= 1 || ++incremental_frames_ % incremental_refresh_ == 0;
+	size_t const changed = engine_->classifyIncremental( cv_ptr->image, encoded_model_, incremental_threshold_, full, encoded_image_ );
+	stats_pub_.set( "changed_tile_ratio", double( changed ) / engine_->tileCount( cv_ptr->image.rows ) );
+      }
+    else
+      engine_->classifyEncoded( cv_ptr->image, encoded_model_, encoded_image_ );
+
+    /// Per-color debug images are only extracted from the encoded image if someone is listening
+    int bit = 0;
+    for( _ColorModelMap::value_type const & color : color_models_ )
+      {
+	image_transport::Publisher & color_pub = classified_image_pub_[ color.first ];
 	
-	for( _CompositeColor::value_type const & color : composite.second )
+	if( color_pub.getNumSubscribers() )
 	  {
-	    ClassifyThreadStorage::Ptr storage = thread_storage_[ color ];
-
-	    if( composite_image.empty() )
-	      {
-		storage->output_.copyTo(composite_image);
-	      }
-	    else
-	      {
-		ROS_ASSERT( storage->output_.type() == composite_image.type() && 
-			    storage->output_.size() == composite_image.size() );
-		
-		cv::bitwise_or( storage->output_, composite_image, composite_image );
-	      }
+	    uscauv::extractColorBit( encoded_image_, bit, debug_image_ );
+	    cv_bridge::CvImage classified_image( cv_ptr->header,
+						 sensor_msgs::image_encodings::MONO8, debug_image_ );
+	    color_pub.publish( classified_image.toImageMsg() );
 	  }
-	encoder.addImage( composite_image, composite.first );
+	++bit;
       }
+
+    uscauv::ColorEncoder encoder;
+    encoder.setImage( encoded_image_, color_names_ );
     
-    /* toc_info_stream( std::chrono::milliseconds, "Classify all"); */
-    
-    encoded_image_pub_.publish( encoder, msg->header );
+    encoded_image_pub_.publish( encoder, cv_ptr->header );
     return;
   }
 
@@ -0,0 +1,193 @@
+/***************************************************************************
+ *  include/color_classification/color_table.h
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_COLORCLASSIFICATION_COLORTABLE
+#define USCAUV_COLORCLASSIFICATION_COLORTABLE
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/ml/ml.hpp>
+
+/// cpp11
+#include <cstdint>
+#include <vector>
+
+/// uscauv
+#include <uscauv_common/color_plane.h>
+
+namespace uscauv
+{
+  /// Number of distinct values of an 8-bit hue or saturation channel
+  static int const COLOR_TABLE_DIM = 256;
+
+  /** 
+   * Evaluate an SVM trained on (H,S) pairs once for every 8-bit (H,S) pair and store the
+   * results in a 256x256 CV_8UC1 table, indexed by hue (row) and saturation (col). Entries are
+   * 255 where the SVM responds with 1 and 0 everywhere else. Because the classifier only ever sees 8-bit
+   * inputs, looking up a pixel in the table gives exactly the same result as calling predict() on it.
+   * 
+   * @param svm SVM with two input variables and output {-1, 1}
+   * @param table Output table
+   * 
+   * @return Number of (H,S) pairs for which the SVM had an invalid response (neither -1 nor 1)
+   */
+  inline int compileColorTable( cv::SVM const & svm, cv::Mat & table )
+  {
+    int invalid_count = 0;
+    
+    table.create( COLOR_TABLE_DIM, COLOR_TABLE_DIM, CV_8UC1 );
+
+    for( int hue = 0; hue < COLOR_TABLE_DIM; ++hue )
+      {
+	unsigned char * table_row = table.ptr<unsigned char>( hue );
+	
+	for( int sat = 0; sat < COLOR_TABLE_DIM; ++sat )
+	  {
+	    /// Same sample layout that the per-pixel classifier used, so that the responses are identical
+	    float response = svm.predict( cv::Mat( cv::Vec2f( hue, sat ) ) );
+	    
+	    if( response == 1.0 )
+	      table_row[ sat ] = 255;
+	    else
+	      {
+		if( response != -1.0 )
+		  ++invalid_count;
+		table_row[ sat ] = 0;
+	      }
+	  }
+      }
+    
+    return invalid_count;
+  }
+
+  /** 
+   * Classify an HSV image by looking up each pixel's (H,S) pair in a table generated by compileColorTable().
+   * 
+   * @param hsv CV_8UC3 HSV image
+   * @param table 256x256 CV_8UC1 table
+   * @param output CV_8UC1 image of the same size as the input. Reallocated only if its size or type is wrong.
+   */
+  inline void applyColorTable( cv::Mat const & hsv, cv::Mat const & table, cv::Mat & output )
+  {
+    CV_Assert( hsv.type() == CV_8UC3 && table.type() == CV_8UC1 && table.isContinuous() &&
+	       table.rows == COLOR_TABLE_DIM && table.cols == COLOR_TABLE_DIM );
+    
+    output.create( hsv.size(), CV_8UC1 );
+
+    unsigned char const * table_ptr = table.ptr<unsigned char>( 0 );
+
+    for( int row = 0; row < hsv.rows; ++row )
+      {
+	unsigned char const * in = hsv.ptr<unsigned char>( row );
+	unsigned char * out = output.ptr<unsigned char>( row );
+
+	for( int col = 0; col < hsv.cols; ++col, in += 3 )
+	  out[ col ] = table_ptr[ ( in[0] << 8 ) + in[1] ];
+      }
+  }
+
+  /** 
+   * Combine several color tables into a single 256x256 table where bit i of each entry is set if entry
+   * in tables[i] is non-zero. The table is a color plane (see uscauv_common/color_plane.h), so classifying
+   * with it produces an image in the format used by uscauv::ColorEncoder directly.
+   * 
+   * @param tables Up to plane_bits tables generated by compileColorTable(). Empty tables leave their bit clear
+   * so that it can be filled in some other way, see uscauv::orColorBit().
+   * @param encoded_table Output table
+   * @param plane_bits Width of the table entries: 16, 32 or 64. Must leave room for any composite bits
+   * that will be added to classified images later.
+   */
+  inline void compileEncodedTable( std::vector<cv::Mat> const & tables, cv::Mat & encoded_table, unsigned int const plane_bits = 16 )
+  {
+    CV_Assert( colorPlaneType( plane_bits ) >= 0 && tables.size() <= plane_bits );
+
+    encoded_table.create( COLOR_TABLE_DIM, COLOR_TABLE_DIM, colorPlaneType( plane_bits ) );
+    encoded_table.setTo( 0 );
+
+    for( size_t idx = 0; idx < tables.size(); ++idx )
+      {
+	cv::Mat const & table = tables[ idx ];
+	if( table.empty() )
+	  continue;
+	
+	CV_Assert( table.type() == CV_8UC1 && table.size() == encoded_table.size() );
+	orColorBit( table, idx, encoded_table );
+      }
+  }
+
+  template<class Word>
+    void applyEncodedTableImpl( cv::Mat const & hsv, cv::Mat const & encoded_table, cv::Mat & output )
+    {
+      Word const * table_ptr = encoded_table.ptr<Word>( 0 );
+      
+      int const cols = hsv.cols;
+      for( int row = 0; row < hsv.rows; ++row )
+	{
+	  unsigned char const * in = hsv.ptr<unsigned char>( row );
+	  Word * out = output.ptr<Word>( row );
+	  
+	  for( int col = 0; col < cols; ++col, in += 3 )
+	    out[ col ] = table_ptr[ ( in[0] << 8 ) + in[1] ];
+	}
+    }
+  
+  /** 
+   * Classify an HSV image against all of the colors in an encoded table at once.
+   * 
+   * @param hsv CV_8UC3 HSV image
+   * @param encoded_table 256x256 table generated by compileEncodedTable()
+   * @param output Color plane of the same size as the input and the same type as the table.
+   * Reallocated only if its size or type is wrong.
+   */
+  inline void applyEncodedTable( cv::Mat const & hsv, cv::Mat const & encoded_table, cv::Mat & output )
+  {
+    unsigned int const plane_bits = colorPlaneTypeBits( encoded_table.type() );
+    CV_Assert( hsv.type() == CV_8UC3 && plane_bits && encoded_table.isContinuous() &&
+	       encoded_table.rows == COLOR_TABLE_DIM && encoded_table.cols == COLOR_TABLE_DIM );
+    
+    output.create( hsv.size(), encoded_table.type() );
+
+    switch( plane_bits )
+      {
+      case 16: applyEncodedTableImpl<uint16_t>( hsv, encoded_table, output ); break;
+      case 32: applyEncodedTableImpl<uint32_t>( hsv, encoded_table, output ); break;
+      case 64: applyEncodedTableImpl<uint64_t>( hsv, encoded_table, output ); break;
+      }
+  }
+
+} // uscauv
+
+#endif // USCAUV_COLORCLASSIFICATION_COLORTABLE
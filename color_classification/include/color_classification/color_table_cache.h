@@ -0,0 +1,244 @@
+/***************************************************************************
+ *  include/color_classification/color_table_cache.h
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_COLORCLASSIFICATION_COLORTABLECACHE
+#define USCAUV_COLORCLASSIFICATION_COLORTABLECACHE
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+
+/// Boost filesystem
+#include <boost/filesystem.hpp>
+
+/// POSIX, for mmap
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/// cpp11
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <iomanip>
+
+namespace uscauv
+{
+  
+  /** 
+   * 64-bit FNV-1a hash of a string, starting from the given hash so that several strings can be chained together.
+   */
+  inline uint64_t hashString( std::string const & data, uint64_t hash = 14695981039346656037ULL )
+  {
+    for( std::string::const_iterator it = data.begin(); it != data.end(); ++it )
+      {
+	hash ^= static_cast<unsigned char>( *it );
+	hash *= 1099511628211ULL;
+      }
+    return hash;
+  }
+
+  /** 
+   * 64-bit FNV-1a hash of a file's contents.
+   * 
+   * @return 0 on success, -1 if the file can't be read
+   */
+  inline int hashFile( std::string const & path, uint64_t & hash )
+  {
+    std::ifstream file( path.c_str(), std::ios::in | std::ios::binary );
+    if( !file )
+      return -1;
+
+    std::stringstream contents;
+    contents << file.rdbuf();
+    
+    hash = hashString( contents.str() );
+    return 0;
+  }
+
+  /**
+   * On-disk cache of compiled color tables (see compileColorTable()). Entries are keyed by a hash of
+   * whatever the table was compiled from, so a changed source file simply misses the cache. Entries
+   * are memory-mapped when loaded, so a hit costs a page fault per page actually used rather than a
+   * parse of the source file.
+   * 
+   * Each entry is a small header followed by the raw table data.
+   */
+  class ColorTableCache
+  {
+  private:
+    struct EntryHeader
+    {
+      char magic_[8];
+      uint64_t key_;
+      int32_t rows_, cols_, type_, reserved_;
+    };
+
+    static char const * magic() { return "USCLUT01"; }
+    
+    boost::filesystem::path directory_;
+
+  public:
+    ColorTableCache( std::string const & directory = "" ): directory_( directory ) {}
+
+    bool enabled() const { return !directory_.empty(); }
+
+    std::string entryPath( std::string const & name, uint64_t const & key ) const
+    {
+      std::stringstream filename;
+      filename << name << "." << std::hex << std::setw( 16 ) << std::setfill( '0' ) << key << ".lut";
+      return ( directory_ / filename.str() ).string();
+    }
+    
+    /** 
+     * Map a cache entry into memory.
+     * 
+     * @param name Name of the table
+     * @param key Hash of the table's source
+     * @param table Output table, which points into the mapped file
+     * @param mapping Keeps the file mapped. table is only valid as long as this (or a copy of it) is alive.
+     * 
+     * @return 0 on a hit, -1 if the entry is missing or invalid
+     */
+    int load( std::string const & name, uint64_t const & key, cv::Mat & table, std::shared_ptr<void const> & mapping ) const
+    {
+      if( !enabled() )
+	return -1;
+      
+      std::string const path = entryPath( name, key );
+      
+      int fd = open( path.c_str(), O_RDONLY );
+      if( fd < 0 )
+	return -1;
+
+      struct stat file_stat;
+      if( fstat( fd, &file_stat ) || file_stat.st_size < (off_t)sizeof( EntryHeader ) )
+	{
+	  close( fd );
+	  return -1;
+	}
+      
+      size_t const length = file_stat.st_size;
+      void * data = mmap( NULL, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+      close( fd );
+      
+      if( data == MAP_FAILED )
+	return -1;
+
+      std::shared_ptr<void const> file_mapping( data, [length]( void const * ptr ){ munmap( const_cast<void *>( ptr ), length ); } );
+
+      EntryHeader header;
+      std::memcpy( &header, data, sizeof( header ) );
+      
+      if( std::memcmp( header.magic_, magic(), sizeof( header.magic_ ) ) || header.key_ != key ||
+	  header.rows_ <= 0 || header.cols_ <= 0 ||
+	  length != sizeof( EntryHeader ) + size_t( header.rows_ ) * header.cols_ * CV_ELEM_SIZE( header.type_ ) )
+	return -1;
+      
+      table = cv::Mat( header.rows_, header.cols_, header.type_,
+		       static_cast<unsigned char *>( data ) + sizeof( EntryHeader ) );
+      mapping = file_mapping;
+      return 0;
+    }
+
+    /** 
+     * Write a table to the cache, replacing any other entries with the same name.
+     * The entry is written to a temporary file first, so a partially written entry is never loaded.
+     * 
+     * @return 0 on success, -1 on failure
+     */
+    int store( std::string const & name, uint64_t const & key, cv::Mat const & table ) const
+    {
+      if( !enabled() || table.empty() )
+	return -1;
+
+      try
+	{
+	  boost::filesystem::create_directories( directory_ );
+
+	  /// Remove stale entries for this table
+	  std::string const prefix = name + ".";
+	  for( boost::filesystem::directory_iterator it( directory_ ); it != boost::filesystem::directory_iterator(); ++it )
+	    {
+	      std::string const filename = it->path().filename().string();
+	      if( filename.compare( 0, prefix.size(), prefix ) == 0 && it->path().extension() == ".lut" )
+		boost::filesystem::remove( it->path() );
+	    }
+	}
+      catch( boost::filesystem::filesystem_error const & )
+	{
+	  return -1;
+	}
+
+      cv::Mat continuous_table = table.isContinuous() ? table : table.clone();
+      
+      EntryHeader header;
+      std::memcpy( header.magic_, magic(), sizeof( header.magic_ ) );
+      header.key_ = key;
+      header.rows_ = continuous_table.rows;
+      header.cols_ = continuous_table.cols;
+      header.type_ = continuous_table.type();
+      header.reserved_ = 0;
+
+      std::string const path = entryPath( name, key ), temp_path = path + ".tmp";
+      
+      {
+	std::ofstream file( temp_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+	file.write( reinterpret_cast<char const *>( &header ), sizeof( header ) );
+	file.write( reinterpret_cast<char const *>( continuous_table.data ), continuous_table.total() * continuous_table.elemSize() );
+	if( !file )
+	  {
+	    std::remove( temp_path.c_str() );
+	    return -1;
+	  }
+      }
+      
+      if( std::rename( temp_path.c_str(), path.c_str() ) )
+	{
+	  std::remove( temp_path.c_str() );
+	  return -1;
+	}
+      
+      return 0;
+    }
+  };
+
+} // uscauv
+
+#endif // USCAUV_COLORCLASSIFICATION_COLORTABLECACHE
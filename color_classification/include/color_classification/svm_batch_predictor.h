@@ -0,0 +1,335 @@
+/***************************************************************************
+ *  include/color_classification/svm_batch_predictor.h
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_COLORCLASSIFICATION_SVMBATCHPREDICTOR
+#define USCAUV_COLORCLASSIFICATION_SVMBATCHPREDICTOR
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/ml/ml.hpp>
+
+/// cpp11
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace uscauv
+{
+
+  /**
+   * cv::SVM keeps its decision function protected. This exposes it read-only so that it can be
+   * evaluated outside of cv::SVM::predict(). Load it exactly like a cv::SVM.
+   */
+  class InspectableSVM: public cv::SVM
+  {
+  public:
+    CvSVMDecisionFunc const * getDecisionFunction() const { return decision_func; }
+    CvMat const * getClassLabels() const { return class_labels; }
+    CvMat const * getVarIdx() const { return var_idx; }
+  };
+
+  /**
+   * Single precision exp() written so that the compiler can vectorize loops that call it
+   * (Cephes expf polynomial, relative error around 2e-7).
+   */
+  inline float batchExp( float x )
+  {
+    x = std::min( std::max( x, -87.3f ), 88.7f );
+
+    /// x = n*ln(2) + r, |r| <= ln(2)/2
+    /// Adding and subtracting 1.5 * 2^23 rounds to the nearest integer without a branch
+    float const fn = ( x * 1.44269504088896341f + 12582912.0f ) - 12582912.0f;
+    int32_t const n = static_cast<int32_t>( fn );
+    x -= fn * 0.693359375f;
+    x -= fn * -2.12194440e-4f;
+
+    float y = 1.9875691500e-4f;
+    y = y * x + 1.3981999507e-3f;
+    y = y * x + 8.3334519073e-3f;
+    y = y * x + 4.1665795894e-2f;
+    y = y * x + 1.6666665459e-1f;
+    y = y * x + 5.0000001201e-1f;
+    y = y * x * x + x + 1.0f;
+
+    /// 2^n, built directly in the exponent bits
+    int32_t const bits = ( n + 127 ) << 23;
+    float pow2n;
+    std::memcpy( &pow2n, &bits, sizeof( pow2n ) );
+    
+    return y * pow2n;
+  }
+
+  /**
+   * Evaluates a two-class cv::SVM over whole rows of HSV pixels at once. The support vectors are copied
+   * into one contiguous array per input dimension, and each support vector is applied to a full row of
+   * pixels (also stored one array per dimension), so the inner loops run over contiguous floats and
+   * vectorize. Linear, polynomial and RBF kernels are supported; anything else is passed through to
+   * cv::SVM::predict() one pixel at a time.
+   *
+   * The vectorized decision function isn't bit-identical to cv::SVM's, so every pixel whose decision
+   * value is within a conservative error bound of the decision boundary is re-evaluated with
+   * cv::SVM::predict(). The labels are therefore always identical to cv::SVM's.
+   *
+   * The input features are the first getVarCount() channels of the HSV image, i.e. (H,S) or (H,S,V).
+   */
+  class SVMBatchPredictor
+  {
+  private:
+    InspectableSVM const * svm_;
+    /// Every pixel goes through cv::SVM::predict()
+    bool exact_only_;
+    
+    int var_count_, sv_count_, kernel_type_;
+    double gamma_, coef0_, degree_, rho_;
+    /// labels for decision values above and at/below zero
+    float label_above_, label_below_;
+    
+    /// var_count_ arrays of sv_count_ floats
+    std::vector<float> sv_;
+    std::vector<double> alpha_;
+
+    /// Scratch space for one row. Each thread gets its own.
+    struct RowBuffers
+    {
+      std::vector<float> features_, kernel_;
+      std::vector<double> sum_, bound_;
+    };
+    
+  public:
+    /// Relative error in the decision value below which a pixel is re-evaluated with cv::SVM::predict()
+    static constexpr double TOLERANCE = 1e-4;
+    
+  SVMBatchPredictor(): svm_( NULL ), exact_only_( true ), var_count_( 0 ), sv_count_( 0 ) {}
+
+    /** 
+     * @param svm Trained SVM. It must outlive this object.
+     * 
+     * @return 0 if the SVM can be evaluated in batches, -1 if every pixel will go through cv::SVM::predict().
+     */
+    int init( InspectableSVM const & svm )
+    {
+      svm_ = &svm;
+      exact_only_ = true;
+      var_count_ = svm.get_var_count();
+      sv_count_ = 0;
+      sv_.clear();
+      alpha_.clear();
+      
+      CvSVMParams const params = svm.get_params();
+      CvSVMDecisionFunc const * df = svm.getDecisionFunction();
+      CvMat const * class_labels = svm.getClassLabels();
+
+      if( ( params.svm_type != cv::SVM::C_SVC && params.svm_type != cv::SVM::NU_SVC ) ||
+	  ( params.kernel_type != cv::SVM::LINEAR && params.kernel_type != cv::SVM::POLY && params.kernel_type != cv::SVM::RBF ) ||
+	  !df || !class_labels || class_labels->cols * class_labels->rows != 2 || svm.getVarIdx() )
+	return -1;
+
+      kernel_type_ = params.kernel_type;
+      gamma_ = params.gamma;
+      coef0_ = params.coef0;
+      degree_ = params.degree;
+      rho_ = df->rho;
+      
+      /// cv::SVM votes for the first class when the decision value is positive
+      label_above_ = static_cast<float>( class_labels->data.i[0] );
+      label_below_ = static_cast<float>( class_labels->data.i[1] );
+
+      sv_count_ = df->sv_count;
+      sv_.resize( var_count_ * sv_count_ );
+      alpha_.resize( sv_count_ );
+      
+      for( int sv_idx = 0; sv_idx < sv_count_; ++sv_idx )
+	{
+	  int const global_idx = df->sv_index ? df->sv_index[ sv_idx ] : sv_idx;
+	  float const * sv = svm.get_support_vector( global_idx );
+
+	  for( int dim = 0; dim < var_count_; ++dim )
+	    sv_[ dim * sv_count_ + sv_idx ] = sv[ dim ];
+	  
+	  alpha_[ sv_idx ] = df->alpha[ sv_idx ];
+	}
+
+      exact_only_ = false;
+      return 0;
+    }
+
+    int getVarCount() const { return var_count_; }
+
+    /** 
+     * Classify an HSV image.
+     * 
+     * @param hsv CV_8UC3 HSV image
+     * @param output CV_8UC1 image of the same size as the input that is 255 where the SVM responds with 1
+     * and 0 everywhere else. Reallocated only if its size or type is wrong.
+     */
+    void classify( cv::Mat const & hsv, cv::Mat & output ) const
+    {
+      CV_Assert( svm_ && hsv.type() == CV_8UC3 && var_count_ >= 1 && var_count_ <= 3 );
+      
+      output.create( hsv.size(), CV_8UC1 );
+
+      static thread_local RowBuffers buffers;
+      
+      for( int row = 0; row < hsv.rows; ++row )
+	classifyRow( hsv.ptr<unsigned char>( row ), hsv.cols, output.ptr<unsigned char>( row ), buffers );
+    }
+
+  private:
+    void classifyRow( unsigned char const * hsv, int const cols, unsigned char * output, RowBuffers & buffers ) const
+    {
+      /// Split the row into one contiguous array per feature
+      buffers.features_.resize( var_count_ * cols );
+      for( int dim = 0; dim < var_count_; ++dim )
+	{
+	  float * feature = &buffers.features_[ dim * cols ];
+	  for( int col = 0; col < cols; ++col )
+	    feature[ col ] = hsv[ 3 * col + dim ];
+	}
+
+      if( exact_only_ )
+	{
+	  for( int col = 0; col < cols; ++col )
+	    output[ col ] = predictExact( &buffers.features_[0], cols, col ) == 1.0 ? 255 : 0;
+	  return;
+	}
+
+      buffers.kernel_.resize( cols );
+      buffers.sum_.assign( cols, -rho_ );
+      buffers.bound_.assign( cols, 0.0 );
+      
+      float * kernel = &buffers.kernel_[0];
+      double * sum = &buffers.sum_[0], * bound = &buffers.bound_[0];
+      
+      for( int sv_idx = 0; sv_idx < sv_count_; ++sv_idx )
+	{
+	  evaluateKernel( &buffers.features_[0], cols, sv_idx, kernel );
+
+	  double const alpha = alpha_[ sv_idx ];
+	  for( int col = 0; col < cols; ++col )
+	    {
+	      double const term = alpha * kernel[ col ];
+	      sum[ col ] += term;
+	      bound[ col ] += std::abs( term );
+	    }
+	}
+
+      for( int col = 0; col < cols; ++col )
+	{
+	  float response;
+	  
+	  /// near the decision boundary, or not finite (eg. an overflowing kernel), cv::SVM decides
+	  if( !std::isfinite( sum[ col ] ) || std::abs( sum[ col ] ) <= TOLERANCE * ( bound[ col ] + std::abs( rho_ ) ) )
+	    response = predictExact( &buffers.features_[0], cols, col );
+	  else
+	    response = sum[ col ] > 0 ? label_above_ : label_below_;
+
+	  output[ col ] = response == 1.0 ? 255 : 0;
+	}
+    }
+
+    /// Kernel between every pixel in the row and one support vector
+    void evaluateKernel( float const * features, int const cols, int const sv_idx, float * kernel ) const
+    {
+      if( kernel_type_ == cv::SVM::RBF )
+	{
+	  std::fill( kernel, kernel + cols, 0.0f );
+	  for( int dim = 0; dim < var_count_; ++dim )
+	    {
+	      float const * feature = features + dim * cols;
+	      float const sv = sv_[ dim * sv_count_ + sv_idx ];
+	      for( int col = 0; col < cols; ++col )
+		{
+		  float const diff = feature[ col ] - sv;
+		  kernel[ col ] += diff * diff;
+		}
+	    }
+
+	  float const neg_gamma = -gamma_;
+	  for( int col = 0; col < cols; ++col )
+	    kernel[ col ] = batchExp( neg_gamma * kernel[ col ] );
+	  return;
+	}
+      
+      /// linear and polynomial kernels are both built on the dot product
+      std::fill( kernel, kernel + cols, 0.0f );
+      for( int dim = 0; dim < var_count_; ++dim )
+	{
+	  float const * feature = features + dim * cols;
+	  float const sv = sv_[ dim * sv_count_ + sv_idx ];
+	  for( int col = 0; col < cols; ++col )
+	    kernel[ col ] += feature[ col ] * sv;
+	}
+
+      if( kernel_type_ == cv::SVM::POLY )
+	{
+	  float const gamma = gamma_, coef0 = coef0_;
+	  int const int_degree = static_cast<int>( degree_ );
+	  
+	  if( int_degree == degree_ && int_degree >= 0 )
+	    {
+	      for( int col = 0; col < cols; ++col )
+		{
+		  float const base = gamma * kernel[ col ] + coef0;
+		  float power = 1.0f;
+		  for( int exponent = 0; exponent < int_degree; ++exponent )
+		    power *= base;
+		  kernel[ col ] = power;
+		}
+	    }
+	  else
+	    {
+	      /// cvPow raises the magnitude of the base to non-integer powers, rather than returning NaN
+	      for( int col = 0; col < cols; ++col )
+		kernel[ col ] = std::pow( std::abs( gamma * kernel[ col ] + coef0 ), static_cast<float>( degree_ ) );
+	    }
+	}
+    }
+
+    /// Evaluate a single pixel exactly the way cv::SVM would
+    float predictExact( float const * features, int const cols, int const col ) const
+    {
+      float sample[3];
+      for( int dim = 0; dim < var_count_; ++dim )
+	sample[ dim ] = features[ dim * cols + col ];
+
+      return svm_->predict( cv::Mat( var_count_, 1, CV_32FC1, sample ) );
+    }
+  };
+
+} // uscauv
+
+#endif // USCAUV_COLORCLASSIFICATION_SVMBATCHPREDICTOR
@@ -0,0 +1,518 @@
+/***************************************************************************
+ *  src/classifier_benchmark.cpp
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/ml/ml.hpp>
+
+/// Boost filesystem
+#include <boost/filesystem.hpp>
+
+/// cpp11
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <random>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+/// uscauv
+#include <uscauv_common/color_plane.h>
+
+/// color_classification
+#include <color_classification/color_table.h>
+#include <color_classification/classification_engine.h>
+#include <color_classification/svm_batch_predictor.h>
+
+namespace _FileSys = boost::filesystem3;
+
+/// Allocation counting ------------------------------------
+
+/// operator new calls made while an AllocationScope is active, from any thread
+static std::atomic<uint64_t> allocation_count( 0 );
+static std::atomic<bool> count_allocations( false );
+
+static void * countedNew( size_t const size, bool const nothrow )
+{
+  if( count_allocations.load( std::memory_order_relaxed ) )
+    allocation_count.fetch_add( 1, std::memory_order_relaxed );
+  if( void * ptr = std::malloc( size ? size : 1 ) )
+    return ptr;
+  if( nothrow )
+    return NULL;
+  throw std::bad_alloc();
+}
+
+void * operator new( size_t size ) { return countedNew( size, false ); }
+void * operator new[]( size_t size ) { return countedNew( size, false ); }
+void * operator new( size_t size, std::nothrow_t const & ) noexcept { return countedNew( size, true ); }
+void * operator new[]( size_t size, std::nothrow_t const & ) noexcept { return countedNew( size, true ); }
+void operator delete( void * ptr ) noexcept { std::free( ptr ); }
+void operator delete[]( void * ptr ) noexcept { std::free( ptr ); }
+void operator delete( void * ptr, std::nothrow_t const & ) noexcept { std::free( ptr ); }
+void operator delete[]( void * ptr, std::nothrow_t const & ) noexcept { std::free( ptr ); }
+
+/**
+ * Measures the heap activity of the code run while it is in scope. operator new calls are counted
+ * directly. OpenCV allocates Mat data with malloc, which is not intercepted; instead the change in
+ * malloc's bytes in use (glibc only) shows buffers that are allocated and kept, eg. outputs that
+ * are recreated at a new size. Short-lived malloc calls that are freed within the scope are not seen.
+ */
+class AllocationScope
+{
+private:
+  uint64_t const count_before_;
+  int64_t const heap_before_;
+
+public:
+  AllocationScope(): count_before_( allocation_count ), heap_before_( heapInUse() ) { count_allocations = true; }
+  ~AllocationScope() { count_allocations = false; }
+
+  uint64_t allocations() const { return allocation_count - count_before_; }
+  int64_t heapGrowth() const { return heapInUse() - heap_before_; }
+
+  /// Bytes malloc has handed out and not yet had back, or 0 if unknown
+  static int64_t heapInUse()
+  {
+#if defined( __GLIBC__ ) && ( __GLIBC__ > 2 || __GLIBC_MINOR__ >= 33 )
+    struct mallinfo2 const info = mallinfo2();
+    return int64_t( info.uordblks + info.hblkhd );
+#elif defined( __GLIBC__ )
+    /// int fields, which wrap past 2GB
+    struct mallinfo const info = mallinfo();
+    return int64_t( unsigned( info.uordblks ) ) + unsigned( info.hblkhd );
+#else
+    return 0;
+#endif
+  }
+};
+
+/// Benchmark setup ------------------------------------
+
+const std::string keys =
+  "{    h| help          |false                      | Print this message.                                    }"
+  "{    i| images        |false                      | Directory of recorded BGR frames to use as well        }"
+  "{    r| resolutions   |320x240,640x480,1280x960   | Comma-separated list of frame sizes                    }"
+  "{    c| colors        |1,4,8,16                   | Comma-separated list of color counts (1-16)            }"
+  "{    b| backends      |table,svm,fused,coarse,incremental | Comma-separated list of backends               }"
+  "{    n| frames        |100                        | Frames to time per configuration                       }"
+  "{    w| warmup        |5                          | Untimed frames before each configuration               }"
+  "{    j| threads       |0                          | Classification threads (0 for one per core)            }"
+  "{    t| tile-rows     |32                         | Rows per work item                                     }"
+  "{    f| format        |json                       | Output format (json, csv)                              }"
+  "{    o| output        |-                          | Output file, or - for stdout                           }"
+  ;
+
+std::vector<std::string> splitList( std::string const & list )
+{
+  std::vector<std::string> items;
+  std::stringstream stream( list );
+  std::string item;
+  while( std::getline( stream, item, ',' ) )
+    if( !item.empty() )
+      items.push_back( item );
+  return items;
+}
+
+/** 
+ * Train an (H,S) SVM that accepts a band of hues around hue_center with reasonably high saturation.
+ * The band is roughly as wide as the real colors we classify, so the number of support vectors is realistic.
+ */
+void trainSyntheticSVM( float const hue_center, uscauv::InspectableSVM & svm )
+{
+  cv::Mat data, responses;
+  for( int hue = 0; hue < 180; hue += 4 )
+    for( int sat = 0; sat < 256; sat += 12 )
+      {
+	float const hue_distance = std::min( std::abs( hue - hue_center ), 180 - std::abs( hue - hue_center ) );
+	data.push_back( cv::Mat( cv::Matx12f( hue, sat ) ) );
+	responses.push_back( hue_distance < 10 && sat > 96 ? 1.0f : -1.0f );
+      }
+
+  cv::SVMParams params;
+  params.svm_type = cv::SVM::C_SVC;
+  params.kernel_type = cv::SVM::RBF;
+  params.gamma = 0.002;
+  params.C = 10;
+  params.term_crit = cv::TermCriteria( CV_TERMCRIT_ITER, 10000, 1e-6f );
+  
+  svm.train( data, responses, cv::Mat(), cv::Mat(), params );
+}
+
+/// Open water with a few colored blobs that move from frame to frame
+void generateFrames( cv::Size const size, int const color_count, size_t const frame_count, std::vector<cv::Mat> & frames )
+{
+  std::mt19937 rng( size.area() + color_count );
+  
+  for( size_t frame_idx = 0; frame_idx < frame_count; ++frame_idx )
+    {
+      cv::Mat hsv( size, CV_8UC3, cv::Scalar( 100, 60, 90 ) );
+
+      /// Sensor noise
+      cv::Mat noise( size, CV_8UC3 );
+      cv::randu( noise, cv::Scalar::all( 0 ), cv::Scalar::all( 8 ) );
+      hsv += noise;
+      
+      for( int blob = 0; blob < 2 * color_count; ++blob )
+	{
+	  int const color = blob % color_count;
+	  cv::Point const center( ( rng() % size.width + frame_idx * 3 ) % size.width, rng() % size.height );
+	  int const radius = size.width / 40 + rng() % ( size.width / 20 );
+	  cv::circle( hsv, center, radius, cv::Scalar( 180.0 * color / color_count + 2, 200, 200 ), -1 );
+	}
+      
+      cv::Mat bgr;
+      cv::cvtColor( hsv, bgr, CV_HSV2BGR );
+      frames.push_back( bgr );
+    }
+}
+
+/// Percentile of a sorted sample
+double percentile( std::vector<double> const & sorted, double const fraction )
+{
+  if( sorted.empty() )
+    return 0.0;
+  return sorted[ std::min( sorted.size() - 1, size_t( fraction * sorted.size() ) ) ];
+}
+
+struct StageTimes
+{
+  std::string name_;
+  std::vector<double> ms_;
+};
+
+struct Result
+{
+  std::string backend_, source_;
+  cv::Size size_;
+  int colors_;
+  size_t frames_;
+  double pixels_per_second_;
+  double allocations_per_frame_;
+  double heap_growth_per_frame_;
+  std::vector<StageTimes> stages_;
+};
+
+typedef std::chrono::steady_clock _Clock;
+
+double elapsedMs( _Clock::time_point const & start, _Clock::time_point const & end )
+{
+  return std::chrono::duration<double, std::milli>( end - start ).count();
+}
+
+/** 
+ * Run one backend over a set of frames. Stages are classify (BGR to per-color masks or encoded image),
+ * encode (masks packed into a plane, separate backends only), compress (run-length encoding for transport)
+ * and decode (every color's mask extracted from the plane, as a subscriber would).
+ */
+Result runBenchmark( std::string const & backend, std::vector<cv::Mat> const & frames, std::vector<uscauv::ColorBackend> const & colors,
+		     uscauv::ColorClassificationEngine & engine, size_t const frame_count, size_t const warmup )
+{
+  Result result;
+  result.backend_ = backend;
+  result.size_ = frames.front().size();
+  result.colors_ = colors.size();
+  result.frames_ = frame_count;
+
+  StageTimes classify = { "classify" }, encode = { "encode" }, compress = { "compress" }, decode = { "decode" };
+  
+  uscauv::EncodedModel model;
+  model.compile( colors, std::vector<std::pair<uint64_t, unsigned int> >(), 16 );
+
+  std::vector<cv::Mat> outputs;
+  cv::Mat encoded, mask;
+  std::vector<uint8_t> compressed;
+  double classify_total_ms = 0;
+  uint64_t allocations = 0;
+  int64_t heap_growth = 0;
+
+  for( size_t iteration = 0; iteration < warmup + frame_count; ++iteration )
+    {
+      cv::Mat const & frame = frames[ iteration % frames.size() ];
+      bool const timed = iteration >= warmup;
+      std::unique_ptr<AllocationScope> scope( timed ? new AllocationScope : NULL );
+      
+      _Clock::time_point const start = _Clock::now();
+      
+      if( backend == "fused" )
+	engine.classifyEncoded( frame, model, encoded );
+      else if( backend == "coarse" )
+	engine.classifyCoarseToFine( frame, model, 4, 1, encoded );
+      else if( backend == "incremental" )
+	engine.classifyIncremental( frame, model, 2.0, iteration % 30 == 0, encoded );
+      else
+	engine.classify( frame, colors, outputs );
+      
+      _Clock::time_point const classified = _Clock::now();
+
+      bool const separate = backend == "table" || backend == "svm";
+      if( separate )
+	{
+	  encoded.create( frame.size(), uscauv::colorPlaneType( 16 ) );
+	  encoded.setTo( 0 );
+	  for( size_t color = 0; color < outputs.size(); ++color )
+	    uscauv::orColorBit( outputs[ color ], color, encoded );
+	}
+      
+      _Clock::time_point const encoded_time = _Clock::now();
+
+      uscauv::encodeColorPlaneRLE( encoded, compressed );
+      
+      _Clock::time_point const compressed_time = _Clock::now();
+
+      for( size_t color = 0; color < colors.size(); ++color )
+	uscauv::extractColorBit( encoded, color, mask );
+      
+      _Clock::time_point const decoded_time = _Clock::now();
+
+      if( !timed )
+	continue;
+      
+      allocations += scope->allocations();
+      heap_growth += scope->heapGrowth();
+      classify_total_ms += elapsedMs( start, classified );
+      classify.ms_.push_back( elapsedMs( start, classified ) );
+      if( separate )
+	encode.ms_.push_back( elapsedMs( classified, encoded_time ) );
+      compress.ms_.push_back( elapsedMs( encoded_time, compressed_time ) );
+      decode.ms_.push_back( elapsedMs( compressed_time, decoded_time ) );
+    }
+
+  result.pixels_per_second_ = classify_total_ms > 0 ? double( result.size_.area() ) * frame_count / ( classify_total_ms / 1000 ) : 0.0;
+  result.allocations_per_frame_ = frame_count ? double( allocations ) / frame_count : 0.0;
+  result.heap_growth_per_frame_ = frame_count ? double( heap_growth ) / frame_count : 0.0;
+
+  for( StageTimes const & stage : { classify, encode, compress, decode } )
+    if( !stage.ms_.empty() )
+      {
+	result.stages_.push_back( stage );
+	std::sort( result.stages_.back().ms_.begin(), result.stages_.back().ms_.end() );
+      }
+  
+  return result;
+}
+
+void writeJson( std::ostream & out, std::vector<Result> const & results, unsigned int const threads )
+{
+  out << "{\n  \"threads\": " << threads << ",\n  \"results\": [\n";
+  for( size_t idx = 0; idx < results.size(); ++idx )
+    {
+      Result const & result = results[ idx ];
+      out << "    { \"backend\": \"" << result.backend_ << "\", \"source\": \"" << result.source_
+	  << "\", \"width\": " << result.size_.width << ", \"height\": " << result.size_.height
+	  << ", \"colors\": " << result.colors_ << ", \"frames\": " << result.frames_
+	  << ", \"pixels_per_second\": " << result.pixels_per_second_
+	  << ", \"allocations_per_frame\": " << result.allocations_per_frame_
+	  << ", \"heap_growth_bytes_per_frame\": " << result.heap_growth_per_frame_ << ", \"stages\": {";
+      
+      for( size_t stage_idx = 0; stage_idx < result.stages_.size(); ++stage_idx )
+	{
+	  StageTimes const & stage = result.stages_[ stage_idx ];
+	  out << ( stage_idx ? ", " : " " ) << "\"" << stage.name_ << "\": { \"p50_ms\": " << percentile( stage.ms_, 0.5 )
+	      << ", \"p90_ms\": " << percentile( stage.ms_, 0.9 ) << ", \"p99_ms\": " << percentile( stage.ms_, 0.99 )
+	      << ", \"max_ms\": " << stage.ms_.back() << " }";
+	}
+      out << " } }" << ( idx + 1 < results.size() ? "," : "" ) << "\n";
+    }
+  out << "  ]\n}\n";
+}
+
+void writeCsv( std::ostream & out, std::vector<Result> const & results )
+{
+  out << "backend,source,width,height,colors,frames,pixels_per_second,allocations_per_frame,heap_growth_bytes_per_frame,stage,p50_ms,p90_ms,p99_ms,max_ms\n";
+  for( Result const & result : results )
+    for( StageTimes const & stage : result.stages_ )
+      out << result.backend_ << "," << result.source_ << "," << result.size_.width << "," << result.size_.height << ","
+	  << result.colors_ << "," << result.frames_ << "," << result.pixels_per_second_ << "," << result.allocations_per_frame_ << ","
+	  << result.heap_growth_per_frame_ << "," << stage.name_ << "," << percentile( stage.ms_, 0.5 ) << "," << percentile( stage.ms_, 0.9 ) << ","
+	  << percentile( stage.ms_, 0.99 ) << "," << stage.ms_.back() << "\n";
+}
+
+int main(int argc, const char ** argv)
+{
+  cv::CommandLineParser parser( argc, argv, keys.c_str() );
+
+  if ( parser.get<bool>("help") )
+    {
+      std::cout << "usage: " << argv[0] << " [--images=\"frame_directory\"] [--format=csv] [--output=results.csv]" << std::endl;
+      parser.printParams();
+      return 0;
+    }
+
+  std::string const image_path = parser.get<std::string>("images");
+  std::string const format = parser.get<std::string>("format");
+  std::string const output_path = parser.get<std::string>("output");
+  size_t const frame_count = std::max( parser.get<int>("frames"), 1 );
+  size_t const warmup = std::max( parser.get<int>("warmup"), 0 );
+  int const threads = std::max( parser.get<int>("threads"), 0 );
+  int const tile_rows = std::max( parser.get<int>("tile-rows"), 1 );
+
+  std::vector<cv::Size> sizes;
+  for( std::string const & resolution : splitList( parser.get<std::string>("resolutions") ) )
+    {
+      cv::Size size;
+      if( sscanf( resolution.c_str(), "%dx%d", &size.width, &size.height ) != 2 || size.width <= 0 || size.height <= 0 )
+	{
+	  std::cerr << "Invalid resolution [ " << resolution << " ]." << std::endl;
+	  return 1;
+	}
+      sizes.push_back( size );
+    }
+
+  std::vector<int> color_counts;
+  for( std::string const & count : splitList( parser.get<std::string>("colors") ) )
+    color_counts.push_back( std::min( std::max( atoi( count.c_str() ), 1 ), 16 ) );
+  int const max_colors = *std::max_element( color_counts.begin(), color_counts.end() );
+  
+  std::vector<std::string> const backends = splitList( parser.get<std::string>("backends") );
+
+  /// Recorded frames, if any ------------------------------------
+  std::vector<cv::Mat> recorded;
+  if( image_path != "false" )
+    {
+      try
+	{
+	  std::vector<_FileSys::path> image_paths;
+	  std::copy( _FileSys::directory_iterator( image_path ), _FileSys::directory_iterator(), std::back_inserter( image_paths ) );
+	  std::sort( image_paths.begin(), image_paths.end() );
+	  
+	  for( _FileSys::path const & path : image_paths )
+	    {
+	      cv::Mat const image = cv::imread( path.string(), CV_LOAD_IMAGE_COLOR );
+	      if( image.data )
+		recorded.push_back( image );
+	    }
+	}
+      catch (const _FileSys::filesystem_error &ex )
+	{
+	  std::cerr << ex.what() << std::endl;
+	  return 1;
+	}
+      std::cerr << "Loaded [ " << recorded.size() << " ] recorded frames." << std::endl;
+    }
+  
+  /// Color models ------------------------------------
+  std::cerr << "Training [ " << max_colors << " ] synthetic color models..." << std::endl;
+
+  std::vector<std::shared_ptr<uscauv::InspectableSVM> > svms;
+  std::vector<uscauv::ColorBackend> table_backends, svm_backends;
+  for( int color = 0; color < max_colors; ++color )
+    {
+      svms.push_back( std::make_shared<uscauv::InspectableSVM>() );
+      trainSyntheticSVM( 180.0f * color / max_colors + 2, *svms.back() );
+
+      cv::Mat table;
+      uscauv::compileColorTable( *svms.back(), table );
+      table_backends.push_back( uscauv::ColorBackend( table ) );
+
+      std::shared_ptr<uscauv::SVMBatchPredictor> predictor = std::make_shared<uscauv::SVMBatchPredictor>();
+      predictor->init( *svms.back() );
+      svm_backends.push_back( uscauv::ColorBackend( std::shared_ptr<uscauv::SVMBatchPredictor const>( predictor ) ) );
+    }
+
+  uscauv::ColorClassificationEngine engine( threads, tile_rows );
+  std::cerr << "Benchmarking on [ " << engine.threads() << " ] threads." << std::endl;
+
+  /// Run ------------------------------------
+  std::vector<Result> results;
+  
+  for( cv::Size const & size : sizes )
+    for( int const color_count : color_counts )
+      {
+	std::vector<std::pair<std::string, std::vector<cv::Mat> > > sources( 1 );
+	sources[0].first = "synthetic";
+	generateFrames( size, color_count, 8, sources[0].second );
+
+	if( !recorded.empty() )
+	  {
+	    sources.push_back( std::make_pair( std::string( "recorded" ), std::vector<cv::Mat>() ) );
+	    for( cv::Mat const & image : recorded )
+	      {
+		cv::Mat resized;
+		cv::resize( image, resized, size, 0, 0, cv::INTER_AREA );
+		sources.back().second.push_back( resized );
+	      }
+	  }
+	
+	for( std::string const & backend : backends )
+	  {
+	    std::vector<uscauv::ColorBackend> const & all_colors = backend == "svm" ? svm_backends : table_backends;
+	    std::vector<uscauv::ColorBackend> const colors( all_colors.begin(), all_colors.begin() + color_count );
+	    
+	    for( std::pair<std::string, std::vector<cv::Mat> > const & source : sources )
+	      {
+		std::cerr << "[ " << backend << " ] [ " << source.first << " ] [ " << size.width << "x" << size.height << " ] [ "
+			  << color_count << " colors ]" << std::endl;
+		
+		/// SVM evaluation is orders of magnitude slower than a lookup, so time fewer frames
+		size_t const frames = backend == "svm" ? std::max<size_t>( frame_count / 10, 1 ) : frame_count;
+		results.push_back( runBenchmark( backend, source.second, colors, engine, frames, warmup ) );
+		results.back().source_ = source.first;
+	      }
+	  }
+      }
+
+  std::ofstream file;
+  if( output_path != "-" )
+    {
+      file.open( output_path.c_str() );
+      if( !file )
+	{
+	  std::cerr << "Failed to open output file [ " << output_path << " ]." << std::endl;
+	  return 1;
+	}
+    }
+  std::ostream & out = output_path != "-" ? file : std::cout;
+  
+  if( format == "csv" )
+    writeCsv( out, results );
+  else
+    writeJson( out, results, engine.threads() );
+  
+  return 0;
+}
@@ -43,6 +43,7 @@
 #include <opencv/cxcore.h>
 
 #include <uscauv_common/macros.h>
+#include <uscauv_common/thread_pool.h>
 
 /// Boost filesystem
 #include <boost/filesystem.hpp>
@@ -50,6 +51,7 @@
 /// C++11 Threading
 #include <thread>
 #include <mutex>
+#include <random>
 
 namespace _FileSys = boost::filesystem3;
 
@@ -64,6 +66,242 @@ std::map<std::string, int> basis_map =
    {"poly", cv::SVM::POLY},
    {"sigmoid", cv::SVM::SIGMOID}};
 
+/// A distinct (H,S) training sample, and how many training pixels with each label it stands for
+struct WeightedSample
+{
+  float hue_, sat_;
+  unsigned int positive_, negative_;
+
+  /// The label that is right for the most pixels
+  float label() const { return positive_ > negative_ ? 1.0f : -1.0f; }
+};
+
+/// Confusion counts, in training pixels
+struct Score
+{
+  uint64_t true_positive_, false_negative_, true_negative_, false_positive_;
+
+  Score(): true_positive_( 0 ), false_negative_( 0 ), true_negative_( 0 ), false_positive_( 0 ) {}
+
+  Score & operator+=( Score const & other )
+  {
+    true_positive_ += other.true_positive_;
+    false_negative_ += other.false_negative_;
+    true_negative_ += other.true_negative_;
+    false_positive_ += other.false_positive_;
+    return *this;
+  }
+
+  uint64_t total() const { return true_positive_ + false_negative_ + true_negative_ + false_positive_; }
+  double accuracy() const { return total() ? double( true_positive_ + true_negative_ ) / total() : 0.0; }
+  double truePositiveRate() const { return true_positive_ ? double( true_positive_ ) / ( true_positive_ + false_negative_ ) : 0.0; }
+  double trueNegativeRate() const { return true_negative_ ? double( true_negative_ ) / ( true_negative_ + false_positive_ ) : 0.0; }
+};
+
+/** 
+ * Collapse training pixels with identical (H,S) values into one weighted sample each. Training pixels
+ * come from 8-bit images, so there are at most 256x256 distinct samples no matter how many pixels there are.
+ * 
+ * @param training One (H,S) CV_32F row per pixel
+ * @param labels One label per pixel, 1 or -1
+ */
+std::vector<WeightedSample> dedupeSamples( cv::Mat const & training, cv::Mat const & labels )
+{
+  std::vector<unsigned int> positive( 256 * 256, 0 ), negative( 256 * 256, 0 );
+
+  for( int row = 0; row < training.rows; ++row )
+    {
+      float const * sample = training.ptr<float>( row );
+      int const idx = ( int( sample[0] ) << 8 ) + int( sample[1] );
+      
+      if( labels.at<float>( row ) == 1.0f )
+	++positive[ idx ];
+      else
+	++negative[ idx ];
+    }
+
+  std::vector<WeightedSample> samples;
+  for( int idx = 0; idx < 256 * 256; ++idx )
+    {
+      if( positive[ idx ] || negative[ idx ] )
+	{
+	  WeightedSample const sample = { float( idx >> 8 ), float( idx & 0xff ), positive[ idx ], negative[ idx ] };
+	  samples.push_back( sample );
+	}
+    }
+  return samples;
+}
+
+/** 
+ * Build OpenCV training data from a subset of weighted samples.
+ *
+ * CvSVM has no per-sample weights, so deduplicating is lossy: each sample appears once with its majority
+ * label, which drops how many pixels it stands for and any minority-label pixels, and so changes the SVM
+ * objective. Without dedupe, each sample is expanded back into one row per training pixel.
+ * 
+ * @param dedupe One row per distinct sample instead of one per pixel
+ * @param class_weights If non-empty, set to per-class weights (in the order -1, 1) that balance the two classes
+ */
+void buildTrainingSet( std::vector<WeightedSample> const & samples, std::vector<size_t> const & indices, bool const dedupe,
+		       cv::Mat & data, cv::Mat & responses, cv::Mat * class_weights = NULL )
+{
+  size_t rows = indices.size();
+  if( !dedupe )
+    {
+      rows = 0;
+      for( size_t const idx : indices )
+	rows += samples[ idx ].positive_ + samples[ idx ].negative_;
+    }
+  
+  data.create( rows, 2, CV_32FC1 );
+  responses.create( rows, 1, CV_32FC1 );
+
+  size_t row = 0, positive_count = 0;
+  auto const append = [&]( WeightedSample const & sample, float const label, unsigned int const count )
+    {
+      for( unsigned int copy = 0; copy < count; ++copy, ++row )
+	{
+	  data.at<float>( row, 0 ) = sample.hue_;
+	  data.at<float>( row, 1 ) = sample.sat_;
+	  responses.at<float>( row ) = label;
+	}
+      if( label == 1.0f )
+	positive_count += count;
+    };
+
+  for( size_t const idx : indices )
+    {
+      WeightedSample const & sample = samples[ idx ];
+      if( dedupe )
+	append( sample, sample.label(), 1 );
+      else
+	{
+	  append( sample, 1.0f, sample.positive_ );
+	  append( sample, -1.0f, sample.negative_ );
+	}
+    }
+
+  if( class_weights )
+    {
+      size_t const negative_count = rows - positive_count;
+      *class_weights = ( cv::Mat_<double>( 1, 2 ) <<
+			 ( negative_count ? double( rows ) / ( 2 * negative_count ) : 1.0 ),
+			 ( positive_count ? double( rows ) / ( 2 * positive_count ) : 1.0 ) );
+    }
+}
+
+/// Score an SVM on a subset of weighted samples. Each sample counts once per training pixel that it stands for.
+Score scoreSamples( cv::SVM const & svm, std::vector<WeightedSample> const & samples, std::vector<size_t> const & indices )
+{
+  Score score;
+  for( size_t const idx : indices )
+    {
+      WeightedSample const & sample = samples[ idx ];
+      float data[] = { sample.hue_, sample.sat_ };
+      
+      if( svm.predict( cv::Mat( 1, 2, CV_32FC1, data ) ) == 1.0f )
+	{
+	  score.true_positive_ += sample.positive_;
+	  score.false_positive_ += sample.negative_;
+	}
+      else
+	{
+	  score.false_negative_ += sample.positive_;
+	  score.true_negative_ += sample.negative_;
+	}
+    }
+  return score;
+}
+
+/// Same spacing as CvParamGrid: min_val, min_val * step, ... while < max_val
+std::vector<double> logGrid( CvParamGrid const & grid )
+{
+  std::vector<double> values;
+  for( double value = grid.min_val; value < grid.max_val; value *= grid.step )
+    values.push_back( value );
+  return values;
+}
+
+/** 
+ * Search the default C (and, for kernels that have one, gamma) grid with k-fold cross-validation. Every
+ * (C, gamma, fold) combination is trained on a separate thread. Folds are split by distinct (H,S) value, and
+ * each fold is trained on the same kind of data as the final model.
+ * 
+ * @param samples Training pixels grouped by (H,S)
+ * @param dedupe Train each fold on distinct samples, see buildTrainingSet
+ * @param params Base parameters. C and gamma are set to the best ones found.
+ * @param folds Number of folds
+ * @param threads Number of threads, or 0 for one per core
+ * @param balance Weight the classes so that they count equally
+ * 
+ * @return Cross-validation score of the best parameters
+ */
+Score gridSearch( std::vector<WeightedSample> const & samples, bool const dedupe, cv::SVMParams & params, int const folds,
+		  unsigned int const threads, bool const balance )
+{
+  std::vector<double> const c_values = logGrid( cv::SVM::get_default_grid( cv::SVM::C ) );
+  std::vector<double> const gamma_values = params.kernel_type == cv::SVM::LINEAR ?
+    std::vector<double>( 1, params.gamma ) : logGrid( cv::SVM::get_default_grid( cv::SVM::GAMMA ) );
+  
+  /// Assign samples to folds in a fixed random order so that results are reproducible
+  std::vector<size_t> order( samples.size() );
+  for( size_t idx = 0; idx < order.size(); ++idx )
+    order[ idx ] = idx;
+  std::shuffle( order.begin(), order.end(), std::mt19937( 0 ) );
+  
+  std::vector<std::vector<size_t> > fold_train( folds ), fold_test( folds );
+  for( size_t pos = 0; pos < order.size(); ++pos )
+    for( int fold = 0; fold < folds; ++fold )
+      ( int( pos % folds ) == fold ? fold_test : fold_train )[ fold ].push_back( order[ pos ] );
+
+  size_t const cell_count = c_values.size() * gamma_values.size();
+  std::vector<Score> scores( cell_count * folds );
+
+  uscauv::ThreadPool pool( threads );
+  std::cout << "Grid search: [ " << c_values.size() << " ] C values x [ " << gamma_values.size() << " ] gamma values x [ "
+	    << folds << " ] folds on [ " << pool.size() << " ] threads." << std::endl;
+
+  pool.run( scores.size(), [&]( size_t const item )
+	    {
+	      size_t const cell = item / folds, fold = item % folds;
+	      cv::SVMParams fold_params = params;
+	      fold_params.C = c_values[ cell / gamma_values.size() ];
+	      fold_params.gamma = gamma_values[ cell % gamma_values.size() ];
+
+	      cv::Mat data, responses, class_weights;
+	      buildTrainingSet( samples, fold_train[ fold ], dedupe, data, responses, balance ? &class_weights : NULL );
+	      CvMat class_weights_header = class_weights;
+	      fold_params.class_weights = balance ? &class_weights_header : NULL;
+	      
+	      cv::SVM svm;
+	      svm.train( data, responses, cv::Mat(), cv::Mat(), fold_params );
+	      scores[ item ] = scoreSamples( svm, samples, fold_test[ fold ] );
+	    });
+
+  /// Ties go to the smallest C and gamma, which generalize best
+  Score best_score;
+  size_t best_cell = 0;
+  for( size_t cell = 0; cell < cell_count; ++cell )
+    {
+      Score cell_score;
+      for( int fold = 0; fold < folds; ++fold )
+	cell_score += scores[ cell * folds + fold ];
+
+      std::cout << "C: " << c_values[ cell / gamma_values.size() ] << ", gamma: " << gamma_values[ cell % gamma_values.size() ]
+		<< ", cross-validation accuracy: " << cell_score.accuracy() << std::endl;
+      
+      if( cell_score.accuracy() > best_score.accuracy() )
+	{
+	  best_score = cell_score;
+	  best_cell = cell;
+	}
+    }
+
+  params.C = c_values[ best_cell / gamma_values.size() ];
+  params.gamma = gamma_values[ best_cell % gamma_values.size() ];
+  return best_score;
+}
+
 const std::string keys =
   "{    h| help          |false | Print this message.                                       }"
   "{    i| input         |false | Training image directory                                  }"
@@ -75,6 +313,11 @@ const std::string keys =
   "{    k| kernel        |rbf   | Kernel type (rbf, linear, poly, sigmoid)                  }"
   "{    a| auto          |false | Automatically search for optimal SVM training parameters. }"
   "{    C| comment       |false | Optional comment to be inserted into output YAML file     }"
+  "{    d| dedupe        |false | Faster but lossy: each distinct (H,S) once, majority label }"
+  "{    b| balance       |false | Weight classes equally                                     }"
+  "{    p| parallel      |false | Parallel k-fold grid search over C and gamma               }"
+  "{    f| folds         |5     | Cross-validation folds for --parallel                      }"
+  "{    j| threads       |0     | Threads for --parallel (0 for one per core)                }"
   ;
 
 int main(int argc, const char ** argv)
@@ -98,6 +341,11 @@ int main(int argc, const char ** argv)
   const double error_penalty    = parser.get<float>("error-penalty");
   const double scale            = parser.get<float>("scale");
   const bool auto_train         = parser.get<bool>("auto");
+  const bool parallel_train     = parser.get<bool>("parallel");
+  const bool dedupe             = parser.get<bool>("dedupe");
+  const bool balance            = parser.get<bool>("balance");
+  const int folds               = std::max( parser.get<int>("folds"), 2 );
+  const int threads             = std::max( parser.get<int>("threads"), 0 );
   
   std::string kernel_str   = parser.get<std::string>("kernel");
   std::transform(kernel_str.begin(), kernel_str.end(), kernel_str.begin(), ::tolower);
@@ -257,6 +505,20 @@ int main(int argc, const char ** argv)
 
   std::cout << "Positive mask contains " << positive_mask_count << " pixels." << std::endl;
 
+  /// Grouping pixels by (H,S) keeps their counts, so it loses nothing by itself. Only --dedupe trains on the groups.
+  std::vector<WeightedSample> const samples = dedupeSamples( all_training, all_mask );
+  std::vector<size_t> all_samples( samples.size() );
+  for( size_t idx = 0; idx < all_samples.size(); ++idx )
+    all_samples[ idx ] = idx;
+  
+  std::cout << "Training data contains " << samples.size() << " distinct (H,S) samples." << std::endl;
+
+  cv::Mat class_weights;
+  if( dedupe || balance )
+    buildTrainingSet( samples, all_samples, dedupe, all_training, all_mask, balance ? &class_weights : NULL );
+  if( dedupe )
+    std::cout << "Training on distinct samples only, with their majority label." << std::endl;
+
   std::cout << "Training SVM..." << std::endl;
   std::cout << "Kernel type: [ " << kernel_str << " ]" << std::endl;
   std::cout << "Max iterations: " << (int)iterations << ", Error penalty: " << error_penalty << std::endl;
@@ -272,6 +534,13 @@ int main(int argc, const char ** argv)
   /// TODO: figure out what these parameters are, and what their counterparts in that output yaml correspond to
   svm_params.term_crit = cv::TermCriteria( CV_TERMCRIT_ITER, (int)iterations, 1e-6f );
 
+  CvMat class_weights_header;
+  if( !class_weights.empty() )
+    {
+      class_weights_header = class_weights;
+      svm_params.class_weights = &class_weights_header;
+    }
+
   time_t before_train, after_train;
   double seconds;
 
@@ -291,7 +560,13 @@ int main(int argc, const char ** argv)
   /// captures local variables by reference
   std::function<void()> train_f;
 
-  if (auto_train )
+  if( parallel_train )
+    train_f = [&]() { Score const cv_score = gridSearch( samples, dedupe, svm_params, folds, threads, balance );
+		      std::cout << "Best parameters: C: " << svm_params.C << ", gamma: " << svm_params.gamma
+				<< ", cross-validation accuracy: " << cv_score.accuracy() << std::endl;
+		      SVM.train( all_training, all_mask, cv::Mat(), cv::Mat(), svm_params ); 
+		      svm_done_mutex.lock(); svm_done = true; svm_done_mutex.unlock(); };
+  else if (auto_train )
     train_f = [&]() { SVM.train_auto( all_training, all_mask, cv::Mat(), cv::Mat(), svm_params ); 
 					  svm_done_mutex.lock(); svm_done = true; svm_done_mutex.unlock(); };
   else
@@ -344,6 +619,11 @@ int main(int argc, const char ** argv)
 
   std::cout << "Training finished in [ " << seconds << " ] seconds." << std::endl;
 
+  /// Scoring the distinct samples by how many pixels they stand for gives the same result as scoring every pixel
+  Score const training_score = scoreSamples( SVM, samples, all_samples );
+  std::cout << "Training set accuracy: " << training_score.accuracy() << ", true positive rate: " << training_score.truePositiveRate()
+	    << ", true negative rate: " << training_score.trueNegativeRate() << std::endl;
+
   /// Run classification on the training images as a sanity check ------------------------------------
 
   std::cout << "Classifying training images..." << std::endl;
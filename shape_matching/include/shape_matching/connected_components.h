@@ -0,0 +1,278 @@
+/***************************************************************************
+ *  include/shape_matching/connected_components.h
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_SHAPEMATCHING_CONNECTEDCOMPONENTS
+#define USCAUV_SHAPEMATCHING_CONNECTEDCOMPONENTS
+
+// cpp
+#include <vector>
+#include <algorithm>
+
+/// opencv
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+namespace uscauv
+{
+
+  /// Area, bounding box and raw moments of one 8-connected blob
+  struct ComponentStats
+  {
+    int area_;
+    cv::Rect bbox_;
+    /// sums of x, y, x^2, xy, y^2 over the blob's pixels
+    double m10_, m01_, m20_, m11_, m02_;
+
+  ComponentStats(): area_(0), m10_(0), m01_(0), m20_(0), m11_(0), m02_(0) {}
+
+    cv::Point2f centroid() const
+    {
+      return area_ ? cv::Point2f( m10_ / area_, m01_ / area_ ) : cv::Point2f();
+    }
+  };
+
+  /**
+   * Labels the 8-connected foreground blobs of a binary image in one raster pass using union-find,
+   * accumulating each blob's statistics on the way. Boundaries are traced afterwards only for the
+   * blobs that are asked for.
+   *
+   * Like cv::findContours, any nonzero pixel is foreground and the outermost row and column on
+   * each side are treated as background, so the traced boundaries are the same point sequences
+   * that findContours reports as outer borders. Hole borders are never traced.
+   *
+   * Buffers are kept between calls. Not safe to share between threads.
+   */
+  class ConnectedComponents
+  {
+  private:
+    /// provisional labels, 0 is background
+    cv::Mat labels_;
+    std::vector<int> parent_;
+    std::vector<ComponentStats> provisional_;
+    /// provisional label -> index in components_, or -1
+    std::vector<int> component_index_;
+    std::vector<ComponentStats> components_;
+
+    /// padded single-blob mask for tracing
+    cv::Mat trace_buffer_;
+    std::vector<std::vector<cv::Point2i> > traced_;
+
+  public:
+    /**
+     * Label the blobs in binary, a CV_8UC1 image.
+     *
+     * @return Number of blobs found
+     */
+    int label( cv::Mat const & binary )
+    {
+      CV_Assert( binary.type() == CV_8UC1 );
+
+      int const rows = binary.rows, cols = binary.cols;
+      labels_.create( rows, cols, CV_32SC1 );
+      labels_ = cv::Scalar( 0 );
+
+      parent_.assign( 1, 0 );
+      provisional_.assign( 1, ComponentStats() );
+      components_.clear();
+
+      for( int y = 1; y < rows - 1; ++y )
+	{
+	  unsigned char const * pixel = binary.ptr<unsigned char>( y );
+	  int * label = labels_.ptr<int>( y );
+	  int const * above = labels_.ptr<int>( y - 1 );
+
+	  for( int x = 1; x < cols - 1; ++x )
+	    {
+	      if( !pixel[ x ] )
+		continue;
+
+	      int current = above[ x ];
+	      if( !current )
+		{
+		  /// With N in the background, W already shares a label with NW, but NE is only
+		  /// connected to the others through this pixel
+		  int const north_east = above[ x + 1 ], west = label[ x - 1 ], north_west = above[ x - 1 ];
+		  current = north_east;
+		  if( west )
+		    current = current ? merge( current, west ) : west;
+		  else if( north_west )
+		    current = current ? merge( current, north_west ) : north_west;
+
+		  if( !current )
+		    {
+		      current = parent_.size();
+		      parent_.push_back( current );
+		      provisional_.push_back( ComponentStats() );
+		      provisional_.back().bbox_ = cv::Rect( x, y, 1, 1 );
+		    }
+		}
+	      label[ x ] = current;
+
+	      ComponentStats & stats = provisional_[ current ];
+	      ++stats.area_;
+	      stats.m10_ += x; stats.m01_ += y;
+	      stats.m20_ += double( x ) * x; stats.m11_ += double( x ) * y; stats.m02_ += double( y ) * y;
+	      growBox( stats.bbox_, x, y );
+	    }
+	}
+
+      /// Fold provisional labels into their roots. Roots always have the lowest label in their set.
+      component_index_.assign( parent_.size(), -1 );
+      for( int idx = 1; idx < int( parent_.size() ); ++idx )
+	{
+	  int const root = find( idx );
+	  if( root == idx )
+	    {
+	      component_index_[ idx ] = components_.size();
+	      components_.push_back( provisional_[ idx ] );
+	    }
+	  else
+	    {
+	      component_index_[ idx ] = component_index_[ root ];
+	      accumulate( components_[ component_index_[ root ] ], provisional_[ idx ] );
+	    }
+	}
+
+      return components_.size();
+    }
+
+    /// Blobs from the last call to label(), in raster order of their first pixel
+    std::vector<ComponentStats> const & components() const { return components_; }
+
+    /**
+     * Trace the outer boundary of a blob from the last call to label().
+     *
+     * @param component Index into components()
+     * @param contour Output boundary, every point as with CV_CHAIN_APPROX_NONE
+     */
+    void trace( int const component, std::vector<cv::Point2i> & contour )
+    {
+      cv::Rect const & bbox = components_[ component ].bbox_;
+
+      trace_buffer_.create( bbox.height + 2, bbox.width + 2, CV_8UC1 );
+      trace_buffer_ = cv::Scalar( 0 );
+
+      for( int y = 0; y < bbox.height; ++y )
+	{
+	  int const * label = labels_.ptr<int>( bbox.y + y ) + bbox.x;
+	  unsigned char * mask = trace_buffer_.ptr<unsigned char>( y + 1 ) + 1;
+	  for( int x = 0; x < bbox.width; ++x )
+	    mask[ x ] = ( label[ x ] && component_index_[ label[ x ] ] == component ) ? 255 : 0;
+	}
+
+      cv::findContours( trace_buffer_, traced_, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE,
+			bbox.tl() - cv::Point2i( 1, 1 ) );
+
+      /// a single 8-connected blob has exactly one outer border
+      if( traced_.empty() )
+	contour.clear();
+      else
+	contour.swap( traced_.front() );
+    }
+
+    /**
+     * Label binary and trace the outer boundary of every blob with at least min_area pixels.
+     *
+     * @return Number of contours
+     */
+    int extract( cv::Mat const & binary, int const min_area, std::vector<std::vector<cv::Point2i> > & contours )
+    {
+      label( binary );
+
+      contours.clear();
+      for( int idx = 0; idx < int( components_.size() ); ++idx )
+	{
+	  if( components_[ idx ].area_ < min_area )
+	    continue;
+
+	  contours.push_back( std::vector<cv::Point2i>() );
+	  trace( idx, contours.back() );
+	}
+
+      return contours.size();
+    }
+
+  private:
+    int find( int label )
+    {
+      while( parent_[ label ] != label )
+	{
+	  parent_[ label ] = parent_[ parent_[ label ] ];
+	  label = parent_[ label ];
+	}
+      return label;
+    }
+
+    /// Union two sets and return the new root, which is the smaller of the two
+    int merge( int first, int second )
+    {
+      first = find( first );
+      second = find( second );
+      if( first == second )
+	return first;
+      if( first > second )
+	std::swap( first, second );
+      parent_[ second ] = first;
+      return first;
+    }
+
+    static void growBox( cv::Rect & box, int const x, int const y )
+    {
+      int const right = std::max( box.x + box.width, x + 1 ), bottom = std::max( box.y + box.height, y + 1 );
+      box.x = std::min( box.x, x );
+      box.y = std::min( box.y, y );
+      box.width = right - box.x;
+      box.height = bottom - box.y;
+    }
+
+    static void accumulate( ComponentStats & stats, ComponentStats const & other )
+    {
+      if( !other.area_ )
+	return;
+
+      cv::Rect const & box = other.bbox_;
+      growBox( stats.bbox_, box.x, box.y );
+      growBox( stats.bbox_, box.x + box.width - 1, box.y + box.height - 1 );
+
+      stats.area_ += other.area_;
+      stats.m10_ += other.m10_; stats.m01_ += other.m01_;
+      stats.m20_ += other.m20_; stats.m11_ += other.m11_; stats.m02_ += other.m02_;
+    }
+  };
+
+} // uscauv
+
+#endif // USCAUV_SHAPEMATCHING_CONNECTEDCOMPONENTS
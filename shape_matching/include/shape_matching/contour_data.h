@@ -0,0 +1,69 @@
+/***************************************************************************
+ *  include/shape_matching/contour_data.h
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_SHAPEMATCHING_CONTOURDATA
+#define USCAUV_SHAPEMATCHING_CONTOURDATA
+
+// cpp
+#include <vector>
+
+/// opencv
+#include <opencv2/core/core.hpp>
+
+/// shape matching
+#include <shape_matching/template_index.h>
+
+typedef std::vector<cv::Point2i> _Contour;
+typedef std::vector<cv::Point2f> _Contour2f;
+typedef cv::Mat                  _Signature;
+
+struct ContourData
+{
+  _Contour2f contour_;   /// original contour in cartesian, for drawing later  (normalized)
+  _Signature signature_; /// radial histogram for EMD, see Rubner EMD paper
+  _Signature spectrum_;  /// Fourier magnitudes of signature_, only computed for the fourier descriptor
+  cv::Point2f mean_;
+  cv::Matx22f eigenvec_; /// principal axes in rows, major first
+  cv::Vec2f eigenval_;   /// major, minor
+  double radius_; /// radius of bounding circle
+  double area_; /// enclosed area in pixels
+  double rotation_; /// rotation from XY in radians (right-handed)
+  uscauv::ShapeInvariants invariants_; /// for rejecting templates before EMD
+
+ContourData(): radius_(0), area_(0), rotation_(0) {}
+};
+
+#endif // USCAUV_SHAPEMATCHING_CONTOURDATA
@@ -0,0 +1,264 @@
+/***************************************************************************
+ *  include/shape_matching/contour_tracker.h
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_SHAPEMATCHING_CONTOURTRACKER
+#define USCAUV_SHAPEMATCHING_CONTOURTRACKER
+
+// cpp
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+/// opencv
+#include <opencv2/core/core.hpp>
+
+/// shape matching
+#include <shape_matching/signature_distance.h>
+
+namespace uscauv
+{
+
+  /// One template that a tracked contour matched
+  struct TrackedMatch
+  {
+    std::string type_;
+    double emd_;
+
+  TrackedMatch(): emd_(0) {}
+  TrackedMatch( std::string const & type, double emd ): type_( type ), emd_( emd ) {}
+  };
+
+  /// Where a contour was in the last frame, and what it matched
+  struct TrackedContour
+  {
+    cv::Rect bbox_;
+    cv::Point2f centroid_;
+    double area_;
+    cv::Mat signature_; /// owned copy of the descriptor that matches_ were scored against
+    std::vector<TrackedMatch> matches_;
+
+  TrackedContour(): area_(0) {}
+  };
+
+  /// Gates for associating a contour with one from the previous frame. A value of zero disables its gate.
+  struct ContourTrackerTolerance
+  {
+    double min_iou_; /// min intersection over union of the bounding boxes
+    double area_;    /// max relative area ratio, ie. larger/smaller - 1
+    double drift_;   /// max distance between the two descriptors for the matches to be reused
+
+  ContourTrackerTolerance(): min_iou_(0.5), area_(0.2), drift_(0.02) {}
+  };
+
+  /// Running totals of how contours were handled
+  struct ContourTrackerStats
+  {
+    size_t contours_; /// contours looked up
+    size_t hits_;     /// matches reused from the previous frame
+    size_t drifted_;  /// associated, but the signature changed too much
+
+  ContourTrackerStats(): contours_(0), hits_(0), drifted_(0) {}
+
+    ContourTrackerStats & operator+=( ContourTrackerStats const & other )
+    {
+      contours_ += other.contours_;
+      hits_ += other.hits_;
+      drifted_ += other.drifted_;
+      return *this;
+    }
+
+    double hitRatio() const { return contours_ ? double( hits_ ) / contours_ : 0.0; }
+  };
+
+  /**
+   * Associates the contours of one color with those of the previous frame, so that a contour whose
+   * signature barely changed can reuse the last frame's template matches instead of being rescored.
+   *
+   * A reused track keeps the descriptor its matches were scored against, so drift is always measured
+   * against that anchor and does not accumulate over frames. Drift has to be measured with the same
+   * metric that the matches were scored with. Then a reused distance differs from the one rescoring
+   * would give by at most the measured drift, which is itself within the drift tolerance. Matches near
+   * the boundary may appear or disappear late.
+   *
+   * Each previous contour is reused at most once per frame. Not safe to share between threads.
+   */
+  class ContourTracker
+  {
+  private:
+    std::vector<TrackedContour> previous_, current_;
+    size_t current_size_;
+    std::vector<bool> claimed_;
+    /// Tracks are only valid for the templates and parameters they were matched with
+    size_t generation_;
+
+  public:
+  ContourTracker(): current_size_( 0 ), generation_( 0 ) {}
+
+    void clear()
+    {
+      previous_.clear();
+      current_size_ = 0;
+      claimed_.clear();
+    }
+
+    /// Start a frame. Tracks from a different generation are dropped.
+    void begin( size_t const generation )
+    {
+      if( generation != generation_ )
+	{
+	  clear();
+	  generation_ = generation;
+	}
+      current_size_ = 0;
+      claimed_.assign( previous_.size(), false );
+    }
+
+    /**
+     * Find the previous contour that this one continues, and whether its matches can be reused.
+     *
+     * @param signature Descriptor that the contour's matches are scored with
+     * @param distance Metric that the matches are scored with, called as distance( cv::Mat, cv::Mat )
+     * @param drift Set to the distance between signature and the returned contour's signature
+     * @return The previous contour, or NULL if the contour has to be rescored. Valid until end().
+     */
+    template<class Distance>
+    TrackedContour const * lookup( cv::Rect const & bbox, cv::Point2f const & centroid, double const area,
+				   cv::Mat const & signature, Distance const & distance,
+				   ContourTrackerTolerance const & tolerance, ContourTrackerStats & stats, double & drift )
+    {
+      ++stats.contours_;
+
+      /// Of the previous contours that overlap enough and are about the same size, take the closest
+      int best = -1;
+      double best_distance = std::numeric_limits<double>::infinity();
+      for( size_t idx = 0; idx < previous_.size(); ++idx )
+	{
+	  TrackedContour const & other = previous_[ idx ];
+	  if( claimed_[ idx ] || other.signature_.total() != signature.total() )
+	    continue;
+
+	  if( tolerance.min_iou_ > 0 && intersectionOverUnion( bbox, other.bbox_ ) < tolerance.min_iou_ )
+	    continue;
+
+	  if( tolerance.area_ > 0 && !withinRatio( area, other.area_, tolerance.area_ ) )
+	    continue;
+
+	  cv::Point2f const shift = centroid - other.centroid_;
+	  double const distance = shift.x * shift.x + shift.y * shift.y;
+	  if( distance < best_distance )
+	    {
+	      best = idx;
+	      best_distance = distance;
+	    }
+	}
+
+      if( best < 0 )
+	return NULL;
+
+      /// Associated either way, so that no other contour takes it over
+      claimed_[ best ] = true;
+      drift = distance( signature, previous_[ best ].signature_ );
+      if( drift > tolerance.drift_ )
+	{
+	  ++stats.drifted_;
+	  return NULL;
+	}
+
+      ++stats.hits_;
+      return &previous_[ best ];
+    }
+
+    /// lookup() for radial signatures scored with the circular EMD
+    TrackedContour const * lookup( cv::Rect const & bbox, cv::Point2f const & centroid, double const area,
+				   cv::Mat const & signature, ContourTrackerTolerance const & tolerance,
+				   ContourTrackerStats & stats, double & drift )
+    {
+      return lookup( bbox, centroid, area, signature,
+		     []( cv::Mat const & first, cv::Mat const & second ){ return circularEMD( first, second ); },
+		     tolerance, stats, drift );
+    }
+
+    /**
+     * Remember a contour of the current frame and its matches, for the next frame.
+     *
+     * @param signature The descriptor that matches were scored against. For a contour that reused a
+     * previous track, that is the track's descriptor, not the contour's own.
+     */
+    void record( cv::Rect const & bbox, cv::Point2f const & centroid, double const area,
+		 cv::Mat const & signature, std::vector<TrackedMatch> const & matches )
+    {
+      /// Entries are reused between frames, so that their buffers are only allocated once
+      if( current_size_ == current_.size() )
+	current_.push_back( TrackedContour() );
+
+      TrackedContour & tracked = current_[ current_size_++ ];
+      tracked.bbox_ = bbox;
+      tracked.centroid_ = centroid;
+      tracked.area_ = area;
+      signature.copyTo( tracked.signature_ );
+      tracked.matches_.assign( matches.begin(), matches.end() );
+    }
+
+    /// Finish a frame. The contours recorded since begin() are associated against next frame.
+    void end()
+    {
+      current_.resize( current_size_ );
+      previous_.swap( current_ );
+      current_size_ = 0;
+    }
+
+    size_t size() const { return previous_.size(); }
+
+  private:
+    static double intersectionOverUnion( cv::Rect const & first, cv::Rect const & second )
+    {
+      double const intersection = ( first & second ).area();
+      double const united = double( first.area() ) + second.area() - intersection;
+      return united > 0 ? intersection / united : 0.0;
+    }
+
+    static bool withinRatio( double first, double second, double const tolerance )
+    {
+      if( first < second )
+	std::swap( first, second );
+      return first <= second * ( 1.0 + tolerance );
+    }
+  };
+
+} // uscauv
+
+#endif // USCAUV_SHAPEMATCHING_CONTOURTRACKER
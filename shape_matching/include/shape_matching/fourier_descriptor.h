@@ -0,0 +1,101 @@
+/***************************************************************************
+ *  include/shape_matching/fourier_descriptor.h
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_SHAPEMATCHING_FOURIERDESCRIPTOR
+#define USCAUV_SHAPEMATCHING_FOURIERDESCRIPTOR
+
+// cpp
+#include <cmath>
+
+/// opencv
+#include <opencv2/core/core.hpp>
+
+namespace uscauv
+{
+
+  /**
+   * Magnitude spectrum of a radial signature, as a rotation invariant shape descriptor.
+   *
+   * Rotating a shape circularly shifts its radial signature, which only changes the phase of its
+   * Fourier coefficients, so the magnitudes don't depend on the PCA alignment in analyzeContour.
+   * They don't distinguish a shape from its mirror image either. The DC term is the signature's
+   * mass, which is always one, so it is left out.
+   *
+   * @param signature CV_32FC1 radial signature with n bins
+   * @param magnitudes Output, n/2 x 1 CV_32FC1: |X_1| ... |X_n/2|
+   */
+  inline void fourierMagnitudes( cv::Mat const & signature, cv::Mat & magnitudes )
+  {
+    CV_Assert( signature.type() == CV_32FC1 && signature.isContinuous() );
+    int const size = signature.total();
+
+    static thread_local cv::Mat spectrum;
+    cv::dft( signature.reshape( 1, 1 ), spectrum, cv::DFT_COMPLEX_OUTPUT );
+
+    magnitudes.create( size / 2, 1, CV_32FC1 );
+    cv::Vec2f const * coefficients = spectrum.ptr<cv::Vec2f>(0);
+    float * output = magnitudes.ptr<float>(0);
+    for( int idx = 0; idx < size / 2; ++idx )
+      {
+	cv::Vec2f const & coefficient = coefficients[ idx + 1 ];
+	output[ idx ] = std::sqrt( coefficient[0] * coefficient[0] + coefficient[1] * coefficient[1] );
+      }
+  }
+
+  /// Euclidean distance between two fourierMagnitudes() descriptors
+  inline double spectrumDistance( float const * first, float const * second, int const size )
+  {
+    double sum = 0;
+    for( int idx = 0; idx < size; ++idx )
+      {
+	double const diff = double( first[ idx ] ) - double( second[ idx ] );
+	sum += diff * diff;
+      }
+    return std::sqrt( sum );
+  }
+
+  inline double spectrumDistance( cv::Mat const & first, cv::Mat const & second )
+  {
+    CV_Assert( first.type() == CV_32FC1 && second.type() == CV_32FC1 );
+    CV_Assert( first.total() == second.total() );
+    CV_Assert( first.isContinuous() && second.isContinuous() );
+
+    return spectrumDistance( first.ptr<float>(0), second.ptr<float>(0), int( first.total() ) );
+  }
+
+} // uscauv
+
+#endif // USCAUV_SHAPEMATCHING_FOURIERDESCRIPTOR
@@ -40,6 +40,9 @@
 // ROS
 #include <ros/ros.h>
 
+// cpp
+#include <set>
+
 // uscauv
 #include <uscauv_common/base_node.h>
 #include <uscauv_common/image_transceiver.h>
@@ -48,6 +51,18 @@
 #include <uscauv_common/graphics.h>
 #include <uscauv_common/color_codec.h>
 #include <uscauv_common/simple_math.h>
+#include <uscauv_common/performance_stats.h>
+#include <uscauv_common/param_loader.h>
+#include <uscauv_common/thread_pool.h>
+
+/// shape matching
+#include <shape_matching/signature_distance.h>
+#include <shape_matching/template_index.h>
+#include <shape_matching/connected_components.h>
+#include <shape_matching/contour_data.h>
+#include <shape_matching/signature_cache.h>
+#include <shape_matching/contour_tracker.h>
+#include <shape_matching/fourier_descriptor.h>
 
 /// opencv
 #include <opencv2/imgproc/imgproc.hpp>
@@ -65,25 +80,28 @@ typedef shape_matching::ShapeMatcherConfig _ShapeMatcherConfig;
 typedef auv_msgs::MatchedShape      _MatchedShape;
 typedef auv_msgs::MatchedShapeArray _MatchedShapeArray;
 
-typedef std::vector<cv::Point2i> _Contour;
-typedef std::vector<cv::Point2f> _Contour2f;
-typedef cv::Mat                  _Signature;
-
 #define DEBUG_SIZE(X, __String)						\
   ROS_INFO("%s has rows: %d, cols: %d, channels: %d", __String, (X).rows, (X).cols, (X).channels() );
 
-struct ContourData
+/// Everything matchColor produces for one color, merged afterwards in color order
+struct ColorMatchResult
 {
-  _Contour2f contour_;   /// original contour in cartesian, for drawing later  (normalized)
-  _Signature signature_; /// radial histogram for EMD, see Rubner EMD paper
-  cv::Point2f mean_;
-  cv::Mat eigenvec_;
-  cv::Mat eigenval_;
-  double radius_; /// radius of bounding circle
-  double rotation_; /// rotation from XY in radians (right-handed)
-
+  std::vector<_MatchedShape> shapes_;
+  uscauv::TemplateIndexStats stats_;
+  uscauv::ContourTrackerStats track_stats_;
+  /// working buffer, kept between frames so that it is only allocated once
+  cv::Mat denoised_;
+  /// debug renderings, only drawn for the debug color while someone is subscribed
+  cv::Mat contour_gray_, contour_image_, match_image_;
+  bool rendered_;
+
+ColorMatchResult(): rendered_( false ) {}
 };
 
+/// Cache tag for template signatures. Bump the version whenever analyzeContour changes what it produces,
+/// so that signatures persisted by an older build are recomputed instead of loaded.
+static char const * const SIGNATURE_DESCRIPTOR = "radial-v3";
+
 typedef std::map<std::string, ContourData> _NamedContourData;
 typedef std::map<std::string, _Contour> _NamedContourMap;
 
@@ -95,18 +113,40 @@ class ShapeMatcherNode: public BaseNode, public ImageTransceiver, public MultiRe
   _NamedContourData templates_;
   _NamedContourMap template_contours_;
   _ImageLoader template_images_;
+  /// hash of each template image, so that signatures can be cached
+  std::map<std::string, uint64_t> template_hashes_;
+  uscauv::SignatureCache signature_cache_;
+  /// file that signature_cache_ is persisted to, or "" to keep it in memory only
+  std::string signature_cache_file_;
   _ShapeMatcherConfig* config_;
   uscauv::EncodedColorSubscriber encoded_image_sub_;
   
   /// ros interfaces
   ros::Publisher match_pub_;
   ros::NodeHandle nh_rel_;
+  uscauv::PerformanceStatsPublisher stats_pub_;
+
+  /// templates_ in matching order, with cheap reject stages in front of EMD
+  uscauv::TemplateIndex template_index_;
+  /// templates_ by Fourier descriptor (only used when descriptor is fourier)
+  uscauv::TemplateIndex spectrum_index_;
   
-  /// cost matrix for EMD algorithm
+  /// cost matrix for EMD algorithm (only used when use_lp_emd is set)
   cv::Mat emd_cost_;
 
+  /// processes colors concurrently. Only exists while parallel_colors is set.
+  std::unique_ptr<uscauv::ThreadPool> pool_;
+  /// size of pool_ (0 for one per core)
+  int pool_threads_;
+  /// one per color, reused between frames
+  std::vector<ColorMatchResult> color_results_;
+  /// contours and matches of the last frame, by color (only used when use_tracking is set)
+  std::map<std::string, uscauv::ContourTracker> trackers_;
+  /// bumped whenever templates or parameters change, which invalidates the trackers
+  size_t generation_;
+
  public:
- ShapeMatcherNode(): BaseNode("ShapeMatcher"), nh_rel_("~")
+ ShapeMatcherNode(): BaseNode("ShapeMatcher"), nh_rel_("~"), pool_threads_( 0 ), generation_( 0 )
     {
       
     }
@@ -124,8 +164,21 @@ class ShapeMatcherNode: public BaseNode, public ImageTransceiver, public MultiRe
        
     /// TODO: Make a MultiPublisher class to make this a little nice
     match_pub_ = nh_rel_.advertise<_MatchedShapeArray>("matched_shapes", 10);
+    stats_pub_.advertise( nh_rel_, "stats", 1 );
+
+    pool_threads_ = std::max( uscauv::param::load<int>( nh_rel_, "threads", 0 ), 0 );
 
        
+    signature_cache_file_ = uscauv::param::load<std::string>( nh_rel_, "signature_cache", "" );
+    if( signature_cache_file_ != "" )
+      {
+	int const loaded = signature_cache_.load( signature_cache_file_ );
+	if( loaded < 0 )
+	  ROS_INFO( "No template signature cache at [ %s ]. It will be created.", signature_cache_file_.c_str() );
+	else
+	  ROS_INFO( "Loaded [ %d ] cached template signatures from [ %s ].", loaded, signature_cache_file_.c_str() );
+      }
+
     /// relative to global namespace, not node namespace
     if(template_images_.loadImagesAt("model/shapes", CV_LOAD_IMAGE_GRAYSCALE ))
       ROS_ERROR("Failed to load shape templates.");
@@ -152,6 +205,7 @@ class ShapeMatcherNode: public BaseNode, public ImageTransceiver, public MultiRe
 	  }
 	
 	template_contours_[ template_it->first ] = contours[0];
+	template_hashes_[ template_it->first ] = uscauv::hashImage( template_it->second );
 	ROS_INFO("Analysis successful.");
       }
     
@@ -176,63 +230,185 @@ class ShapeMatcherNode: public BaseNode, public ImageTransceiver, public MultiRe
     _MatchedShapeArray matches;
     /// so that time and frame data is preserved
     matches.header = header;
-    matches.image_rows = msg->begin()->second.rows; /// all images should have same size
-    matches.image_cols = msg->begin()->second.cols;
-    
-    for(uscauv::ColorImageMap::const_iterator color_it = msg->begin(); color_it != msg->end(); ++color_it )
+    matches.image_rows = msg->rows(); /// all colors share one image
+    matches.image_cols = msg->cols();
+
+    /// Snapshot, so that every color sees the same parameters
+    _ShapeMatcherConfig const config = *config_;
+
+    uscauv::TemplateIndexTolerance tolerance;
+    tolerance.eccentricity_ = config.eccentricity_tolerance;
+    tolerance.area_ = config.area_tolerance;
+    tolerance.perimeter_ = config.perimeter_tolerance;
+    tolerance.use_bound_ = config.use_emd_bound;
+    template_index_.setTolerance( tolerance );
+
+    /// The EMD bound doesn't apply to spectrum distances
+    tolerance.use_bound_ = false;
+    spectrum_index_.setTolerance( tolerance );
+
+    std::vector<std::string> const colors( msg->begin(), msg->end() );
+    color_results_.resize( colors.size() );
+
+    /// Created up front, since the map can't be modified from concurrent color tasks
+    std::vector<uscauv::ContourTracker *> trackers( colors.size(), NULL );
+    if( config.use_tracking )
+      for( size_t idx = 0; idx < colors.size(); ++idx )
+	trackers[ idx ] = &trackers_[ colors[ idx ] ];
+    else
+      trackers_.clear();
+
+    /// Debug images are expensive to draw, and usually nobody is listening
+    bool const publish_denoised = getNumSubscribers( "image_denoised" );
+    bool const publish_contours = getNumSubscribers( "image_contours" );
+    bool const publish_matched = getNumSubscribers( "image_matched" );
+    bool const render_debug = publish_contours || publish_matched;
+
+    auto const match_color = [&]( size_t const idx )
+      {
+	bool const debug = colors[ idx ] == config.debug_color;
+	matchColor( msg->at( colors[ idx ] ), colors[ idx ], config,
+		    debug && render_debug, debug && publish_denoised, trackers[ idx ], color_results_[ idx ] );
+      };
+
+    /// Colors are independent, so they can be processed in any order. Results are merged in color order either way.
+    if( config.parallel_colors && pool_ && colors.size() > 1 )
+      pool_->run( colors.size(), match_color );
+    else
+      for( size_t idx = 0; idx < colors.size(); ++idx )
+	match_color( idx );
+
+    uscauv::TemplateIndexStats stats;
+    uscauv::ContourTrackerStats track_stats;
+    for( size_t idx = 0; idx < colors.size(); ++idx )
       {
+	ColorMatchResult const & result = color_results_[ idx ];
+	matches.shapes.insert( matches.shapes.end(), result.shapes_.begin(), result.shapes_.end() );
+	stats += result.stats_;
+	track_stats += result.track_stats_;
+
 	// ################################################################
-	// Apply a gaussian blur and threshold ############################
+	// Publish results ################################################
 	// ################################################################
-	cv::Mat denoised; color_it->second.copyTo(denoised);
-    
-	const int struct_elem_size = config_->struct_elem_size;
-	int kernel_size = config_->kernel_size;
-	double const  floor_threshold = config_->floor_threshold;
-	kernel_size = (kernel_size % 2) ? kernel_size : kernel_size + 1;
-
-	if( config_->use_morph )
-	  {
-	    cv::morphologyEx( denoised, denoised, cv::MORPH_OPEN, 
-			      cv::getStructuringElement( cv::MORPH_ELLIPSE, 
-							 cv::Size( struct_elem_size, 
-								   struct_elem_size ) ) );
-	  }
-    
-	if( config_->use_blur )
+       
+	/// toImageMsg copies, so the buffers can be reused as soon as these return
+	if( colors[ idx ] == config.debug_color )
 	  {
-	    cv::GaussianBlur( denoised, denoised, cv::Size(kernel_size, kernel_size), 0, 0);
+	    /// sensor_msgs::image_encodings::MONO8 = "mono8", for reference
+	    if( publish_denoised )
+	      publishImage( "image_denoised", boost::make_shared<cv_bridge::CvImage>
+			    ( header, sensor_msgs::image_encodings::MONO8, result.denoised_ ) );
+	    if( publish_contours && result.rendered_ )
+	      publishImage( "image_contours", boost::make_shared<cv_bridge::CvImage>
+			    ( header, sensor_msgs::image_encodings::BGR8, result.contour_image_ ) );
+	    if( publish_matched && result.rendered_ )
+	      publishImage( "image_matched", boost::make_shared<cv_bridge::CvImage>
+			    ( header, sensor_msgs::image_encodings::BGR8, result.match_image_ ) );
 	  }
+      }
+
+    /// publish matched shapes
+    if (matches.shapes.size() > 0 )
+      match_pub_.publish( matches );
+
+    stats_pub_.set( "template_pairs", stats.pairs_ );
+    stats_pub_.set( "eccentricity_rejects", stats.eccentricity_rejects_ );
+    stats_pub_.set( "area_rejects", stats.area_rejects_ );
+    stats_pub_.set( "perimeter_rejects", stats.perimeter_rejects_ );
+    stats_pub_.set( "bound_rejects", stats.bound_rejects_ );
+    stats_pub_.set( "emd_scored", stats.scored_ );
+    stats_pub_.set( "tracked_contours", track_stats.contours_ );
+    stats_pub_.set( "track_hits", track_stats.hits_ );
+    stats_pub_.set( "track_drifted", track_stats.drifted_ );
+    stats_pub_.set( "track_hit_ratio", track_stats.hitRatio() );
+    stats_pub_.publish( header );
 
-	if( config_->use_floor)
-	  cv::threshold( denoised, denoised, floor_threshold, 0, cv::THRESH_TOZERO );
-	if( config_->use_otsu )
-	  cv::threshold( denoised, denoised, 0, 255, cv::THRESH_BINARY + cv::THRESH_OTSU);
+    return;
+  }
+
+  /**
+   * Denoise one color mask, segment it into contours and match them against the templates.
+   * Only reads shared state, so it is called concurrently for different colors.
+   *
+   * @param render Draw contours and matches into output's debug images
+   * @param keep_denoised Leave output.denoised_ intact so that it can be published
+   * @param tracker This color's contours from the last frame, or NULL to match every contour from scratch
+   */
+  void matchColor( cv::Mat const & mask, std::string const & color, _ShapeMatcherConfig const & config,
+		   bool const render, bool const keep_denoised, uscauv::ContourTracker * tracker,
+		   ColorMatchResult & output )
+  {
+    output.shapes_.clear();
+    output.stats_ = uscauv::TemplateIndexStats();
+    output.track_stats_ = uscauv::ContourTrackerStats();
+    output.rendered_ = render;
+
+    // ################################################################
+    // Apply a gaussian blur and threshold ############################
+    // ################################################################
+    /// The mask is only decoded here, and is shared, so work on a copy
+    cv::Mat & denoised = output.denoised_;
+    mask.copyTo(denoised);
     
-	/* cv::adaptiveThreshold( msg->image, denoised, 255, cv::ADAPTIVE_THRESH_GAUSSIAN_C,  */
-	/* 			   cv::THRESH_BINARY, kernel_size,  */
-	/* 			   getLatestConfig<_ShapeMatcherConfig>("image_proc").c ); */
+    const int struct_elem_size = config.struct_elem_size;
+    int kernel_size = config.kernel_size;
+    double const  floor_threshold = config.floor_threshold;
+    kernel_size = (kernel_size % 2) ? kernel_size : kernel_size + 1;
 
-	// ################################################################
-	// Segment out contours ############################################
-	// ################################################################
-        
-	cv::Mat contour_image;
-	denoised.copyTo(contour_image);
+    if( config.use_morph )
+      {
+	cv::morphologyEx( denoised, denoised, cv::MORPH_OPEN, 
+			  cv::getStructuringElement( cv::MORPH_ELLIPSE, 
+						     cv::Size( struct_elem_size, 
+							       struct_elem_size ) ) );
+      }
     
-	std::vector<std::vector<cv::Point2i> > contours;
-	std::vector<cv::Vec4i> hierarchy;
+    if( config.use_blur )
+      {
+	cv::GaussianBlur( denoised, denoised, cv::Size(kernel_size, kernel_size), 0, 0);
+      }
 
-	cv::findContours( contour_image, contours, hierarchy, 
-			  CV_RETR_TREE, CV_CHAIN_APPROX_NONE );
+    if( config.use_floor)
+      cv::threshold( denoised, denoised, floor_threshold, 0, cv::THRESH_TOZERO );
+    if( config.use_otsu )
+      cv::threshold( denoised, denoised, 0, 255, cv::THRESH_BINARY + cv::THRESH_OTSU);
     
-	cv::cvtColor( contour_image, contour_image, CV_GRAY2BGR );    
+    /* cv::adaptiveThreshold( msg->image, denoised, 255, cv::ADAPTIVE_THRESH_GAUSSIAN_C,  */
+    /* 			   cv::THRESH_BINARY, kernel_size,  */
+    /* 			   getLatestConfig<_ShapeMatcherConfig>("image_proc").c ); */
+
+    // ################################################################
+    // Segment out contours ############################################
+    // ################################################################
+        
+    std::vector<std::vector<cv::Point2i> > contours;
+    std::vector<cv::Vec4i> hierarchy;
 
+    /// findContours modifies its input, so it gets a copy if denoised is going to be published
+    bool const copy_input = keep_denoised && !config.use_components;
+    cv::Mat & contour_input = copy_input ? output.contour_gray_ : denoised;
+    if( copy_input )
+      denoised.copyTo( contour_input );
+
+    if( config.use_components )
+      {
+	/// Only outer borders of blobs that pass the size gate are traced, so there is no hierarchy
+	static thread_local uscauv::ConnectedComponents components;
+	components.extract( contour_input, config.min_contour_size, contours );
+      }
+    else
+      cv::findContours( contour_input, contours, hierarchy, 
+			CV_RETR_TREE, CV_CHAIN_APPROX_NONE );
+    
+    if( render )
+      {
+	cv::Mat & contour_image = output.contour_image_;
+	cv::cvtColor( contour_input, contour_image, CV_GRAY2BGR );    
 
 	for(unsigned int idx = 0; idx < contours.size(); ++idx)
 	  {
 	    /// If the contour has a parent; it is a child
-	    if( hierarchy[idx][3] != -1 )
+	    if( !hierarchy.empty() && hierarchy[idx][3] != -1 )
 	      {
 		cv::drawContours(contour_image, contours, idx, uscauv::CV_PINK_BGR,
 				 2, 8, hierarchy);
@@ -242,249 +418,413 @@ class ShapeMatcherNode: public BaseNode, public ImageTransceiver, public MultiRe
 			       2, 8, hierarchy);
 	  }
 
-	// ################################################################
-	// Analyze contours and match shapes ##############################
-	// ################################################################
+	contour_image.copyTo(output.match_image_);
+      }
+
+    // ################################################################
+    // Analyze contours and match shapes ##############################
+    // ################################################################
 
-	cv::Mat match_image;
-	contour_image.copyTo(match_image);
+    cv::Mat & match_image = output.match_image_;
     
-	for(unsigned int idx = 0; idx < contours.size(); ++idx )
+    /// reused across contours and frames so that analyzeContour does not allocate
+    static thread_local ContourData result;
+
+    /// template matches of the current contour, for the tracker
+    static thread_local std::vector<uscauv::TrackedMatch> found;
+
+    bool const use_fourier = config.descriptor == "fourier";
+
+    uscauv::ContourTrackerTolerance track_tolerance;
+    track_tolerance.min_iou_ = config.track_min_iou;
+    track_tolerance.area_ = config.track_area_tolerance;
+    track_tolerance.drift_ = config.track_max_drift;
+    if( tracker )
+      tracker->begin( generation_ );
+
+    for(unsigned int idx = 0; idx < contours.size(); ++idx )
+      {
+	if(analyzeContour( contours[ idx ], result, config.signature_size ))
+	  continue;
+
+	if( use_fourier )
+	  uscauv::fourierMagnitudes( result.signature_, result.spectrum_ );
+    
+	auto emit = [&]( std::string const & type, double emd )
+	{
+	  ROS_DEBUG("[ %s ] EMD: %f", type.c_str(), emd );
+
+	  /// Draw 
+	  ROS_DEBUG("Match detected.");
+	  if( render )
+	    {
+	      result.contour_ = templates_.find( type )->second.contour_;
+	      drawContour(match_image, result, type);
+	    }
+
+	  /// Populate match message
+	  _MatchedShape match;
+
+	  match.x = result.mean_.x;
+	  match.y = result.mean_.y;
+	  match.theta = result.rotation_;
+	  match.scale = result.radius_;
+
+	  match.color = color;
+	  match.type = type;
+
+	  /// Arbitrary measure of confidence. Covariance matrix is diagonal to reflect uncorrelatedness of parameters.
+	  match.covariance = { {emd, 0, 0, 0,
+				0, emd, 0, 0,
+				0, 0, emd, 0,
+				0, 0, 0, emd} };
+
+	  output.shapes_.push_back( match );
+	  if( tracker )
+	    found.push_back( uscauv::TrackedMatch( type, emd ) );
+	};
+
+	found.clear();
+	cv::Rect bbox;
+	uscauv::TrackedContour const * previous = NULL;
+	double drift = 0;
+	if( tracker )
 	  {
-	    ContourData result;
-	    if(analyzeContour( contours[ idx ], result, config_->signature_size ))
-	      continue;
-	
-	    for(_NamedContourData::const_iterator template_it = templates_.begin();
-		template_it != templates_.end(); ++template_it )
+	    bbox = cv::boundingRect( contours[ idx ] );
+	    if( use_fourier )
+	      previous = tracker->lookup( bbox, result.mean_, result.area_, result.spectrum_,
+					  []( cv::Mat const & first, cv::Mat const & second )
+					  { return uscauv::spectrumDistance( first, second ); },
+					  track_tolerance, output.track_stats_, drift );
+	    else
+	      previous = tracker->lookup( bbox, result.mean_, result.area_, result.signature_,
+					  track_tolerance, output.track_stats_, drift );
+	  }
+
+	/// The same shape as last frame, so it gets the same matches at its new pose. Drift is measured with
+	/// the scoring metric, so the true distance is within drift of the one it was scored with, and the
+	/// upper end of that range is reported.
+	if( previous )
+	  for( std::vector<uscauv::TrackedMatch>::const_iterator match_it = previous->matches_.begin();
+	       match_it != previous->matches_.end(); ++match_it )
+	    emit( match_it->type_, match_it->emd_ + drift );
+	else if( config.best_match_only )
+	  {
+	    /// Only the closest template is reported; ties go to the first template in index order
+	    uscauv::TemplateIndex::Entry const * best = NULL;
+	    double best_emd = 0;
+	    auto keep_best = [&]( uscauv::TemplateIndex::Entry const & entry, double emd )
 	      {
-		/// calculate EMD using our custom cost matrix
-		double emd = cv::EMD( result.signature_, template_it->second.signature_,
-				      CV_DIST_USER, emd_cost_ );
-		ROS_DEBUG("[ %s ] EMD: %f", template_it->first.c_str(), emd );
-	    
-		if( emd < config_->emd_boundary )
+		if( !best || emd < best_emd )
 		  {
-		    /// Draw 
-		    ROS_DEBUG("Match detected.");
-		    result.contour_ = template_it->second.contour_;
-		    drawContour(match_image, result, template_it->first);
-
-		    /// Populate match message
-		    _MatchedShape match;
-
-		    match.x = result.mean_.x;
-		    match.y = result.mean_.y;
-		    match.theta = result.rotation_;
-		    match.scale = result.radius_;
-		
-		    match.color = color_it->first;
-		    match.type = template_it->first;
-
-		    /// Arbitrary measure of confidence. Covariance matrix is diagonal to reflect uncorrelatedness of parameters.
-		    match.covariance = { {emd, 0, 0, 0,
-					  0, emd, 0, 0,
-					  0, 0, emd, 0,
-					  0, 0, 0, emd} };
-
-		    matches.shapes.push_back( match );
+		    best = &entry;
+		    best_emd = emd;
 		  }
-	      }
-	
-	    /// finish analyzing, draw
-	    /* cv::Point2f const & mean = result.mean_; */
-
-	    /* ROS_INFO("Got mean %f, %f", mean.x, mean.y ); */
-	    /* ROS_INFO("Got rotation %f.", result.rotation_ * 180 / M_PI); */
-	    /* ROS_INFO("Got bounding circle radius: %f", result.radius_ ); */
-	    /* cv::circle(match_image, mean, result.radius_, uscauv::CV_RED_BGR, 2); */
-	
+	      };
+	    queryTemplates( result, config, keep_best, output.stats_ );
+	    if( best )
+	      emit( best->name_, best_emd );
 	  }
+	else
+	  queryTemplates( result, config,
+			  [&]( uscauv::TemplateIndex::Entry const & entry, double emd ){ emit( entry.name_, emd ); },
+			  output.stats_ );
+
+	/// A reused track keeps the signature and distances it was scored with, so that drift does not accumulate
+	if( previous )
+	  tracker->record( bbox, result.mean_, result.area_, previous->signature_, previous->matches_ );
+	else if( tracker )
+	  tracker->record( bbox, result.mean_, result.area_, use_fourier ? result.spectrum_ : result.signature_, found );
     
+	/// finish analyzing, draw
+	/* cv::Point2f const & mean = result.mean_; */
 
-	// ################################################################
-	// Publish results ################################################
-	// ################################################################
-       
-	if( color_it->first == config_->debug_color )
-	  {
-	    /// sensor_msgs::image_encodings::MONO8 = "mono8", for reference
-	    cv_bridge::CvImage::Ptr denoised_output = boost::make_shared<cv_bridge::CvImage>
-	      ( header, sensor_msgs::image_encodings::MONO8, denoised );
-	    cv_bridge::CvImage::Ptr contour_output = boost::make_shared<cv_bridge::CvImage>
-	      ( header, sensor_msgs::image_encodings::BGR8, contour_image );
-	    cv_bridge::CvImage::Ptr match_output = boost::make_shared<cv_bridge::CvImage>
-	      ( header, sensor_msgs::image_encodings::BGR8, match_image );
-
-	    publishImage(
-			 "image_contours", contour_output, 
-			 "image_denoised", denoised_output,
-			 "image_matched", match_output 
-			 );
-	  }
+	/* ROS_INFO("Got mean %f, %f", mean.x, mean.y ); */
+	/* ROS_INFO("Got rotation %f.", result.rotation_ * 180 / M_PI); */
+	/* ROS_INFO("Got bounding circle radius: %f", result.radius_ ); */
+	/* cv::circle(match_image, mean, result.radius_, uscauv::CV_RED_BGR, 2); */
+    
+      }
+
+    if( tracker )
+      tracker->end();
+  }
 
+  /**
+   * Visit every template within config.emd_boundary of a contour, or within config.fourier_boundary
+   * for the fourier descriptor. The closed-form EMD is scored in batches through the index's
+   * template block; cv::EMD and spectrum distances are scored one pair at a time.
+   */
+  template<class Visit>
+  void queryTemplates( ContourData const & contour, _ShapeMatcherConfig const & config,
+		       Visit visit, uscauv::TemplateIndexStats & stats ) const
+  {
+    if( config.descriptor == "fourier" )
+      {
+	spectrum_index_.query
+	  ( contour.spectrum_, contour.invariants_, config.fourier_boundary,
+	    []( cv::Mat const & spectrum, cv::Mat const & template_spectrum )
+	    {
+	      return uscauv::spectrumDistance( spectrum, template_spectrum );
+	    },
+	    visit, stats );
+	return;
       }
 
-    /// publish matched shapes
-    if (matches.shapes.size() > 0 )
-      match_pub_.publish( matches );
+    if( !config.use_lp_emd )
+      {
+	template_index_.query( contour.signature_, contour.invariants_, config.emd_boundary, visit, stats );
+	return;
+      }
 
-    return;
+    /// calculate EMD using our custom cost matrix
+    template_index_.query
+      ( contour.signature_, contour.invariants_, config.emd_boundary,
+	[&]( cv::Mat const & signature, cv::Mat const & template_signature )
+	{
+	  return double( cv::EMD( signature, template_signature, CV_DIST_USER, emd_cost_ ) );
+	},
+	visit, stats );
   }
 
   /// prefer to use config instead of config_ within this function
   void reconfigureCallback( _ShapeMatcherConfig const & config )
   {
+    /// Worker threads are only kept around while they are used
+    if( config.parallel_colors && !pool_ )
+      pool_.reset( new uscauv::ThreadPool( pool_threads_ ) );
+    else if( !config.parallel_colors )
+      pool_.reset();
+
     /// TODO: Cost type as a config argument
-    circularCostEuclidian( emd_cost_, config.signature_size );
+    if( emd_cost_.rows != config.signature_size )
+      circularCostEuclidian( emd_cost_, config.signature_size );
     /* ROS_INFO("Computed [ %dx%d ] circulant cost matrix.", emd_cost_.rows, emd_cost_.cols); */
 
+    /// Template signatures only depend on the template image and signature_size, so most
+    /// reconfigures are served entirely from the cache
+    int computed = 0, cached = 0;
     for(_NamedContourMap::const_iterator contour_it = template_contours_.begin();
 	contour_it != template_contours_.end(); ++contour_it)
       {
-	ROS_INFO("Generating template signature [ %s ]...", contour_it->first.c_str() );
+	uscauv::SignatureCacheKey key;
+	key.image_hash_ = template_hashes_[ contour_it->first ];
+	key.signature_size_ = config.signature_size;
+	key.descriptor_ = SIGNATURE_DESCRIPTOR;
+
 	ContourData result;
+	if( signature_cache_.find( key, result ) )
+	  {
+	    templates_[ contour_it->first ] = result;
+	    ++cached;
+	    continue;
+	  }
+
+	ROS_INFO("Generating template signature [ %s ]...", contour_it->first.c_str() );
 	if(analyzeContour( contour_it->second, result,config.signature_size ))
-	  ROS_WARN("Signaure generation failed.");
+	  {
+	    ROS_WARN("Signaure generation failed.");
+	    /// don't leave a signature of the wrong size behind
+	    templates_.erase( contour_it->first );
+	  }
 	else
 	  {
 	    templates_[ contour_it->first ] = result;
+	    signature_cache_.insert( key, result );
+	    ++computed;
 	    ROS_INFO("Signature generation success.");
 	  }
       }
 
+    if( computed )
+      ROS_INFO( "Generated [ %d ] template signatures, [ %d ] cached.", computed, cached );
+
+    /// Entries from older analyses or templates that are gone would otherwise accumulate in the file
+    std::set<uint64_t> loaded_hashes;
+    for( std::map<std::string, uint64_t>::const_iterator hash_it = template_hashes_.begin();
+	 hash_it != template_hashes_.end(); ++hash_it )
+      loaded_hashes.insert( hash_it->second );
+    signature_cache_.prune( [&]( uscauv::SignatureCacheKey const & key )
+			    { return key.descriptor_ == SIGNATURE_DESCRIPTOR && loaded_hashes.count( key.image_hash_ ); } );
+
+    if( signature_cache_file_ != "" && signature_cache_.dirty() &&
+	signature_cache_.save( signature_cache_file_ ) )
+      ROS_WARN( "Failed to write template signature cache [ %s ].", signature_cache_file_.c_str() );
+
+    template_index_.clear();
+    for(_NamedContourData::const_iterator template_it = templates_.begin();
+	template_it != templates_.end(); ++template_it )
+      template_index_.add( template_it->first, template_it->second.signature_, template_it->second.invariants_ );
+
+    /// Spectra are cheap to derive from the (cached) signatures, so they are not cached themselves
+    spectrum_index_.clear();
+    if( config.descriptor == "fourier" )
+      for(_NamedContourData::iterator template_it = templates_.begin();
+	  template_it != templates_.end(); ++template_it )
+	{
+	  uscauv::fourierMagnitudes( template_it->second.signature_, template_it->second.spectrum_ );
+	  spectrum_index_.add( template_it->first, template_it->second.spectrum_, template_it->second.invariants_ );
+	}
+    else if( config.descriptor != "emd" )
+      ROS_WARN( "Unknown descriptor [ %s ]. Using emd.", config.descriptor.c_str() );
+
+    /// Tracked matches were made with the old templates and parameters
+    ++generation_;
 
     return;
   }
 
  private:
   
+  /**
+   * Compute the mean, principal axes, bounding radius and radial signature of a contour.
+   *
+   * The signature is the mean radius of the points in each of nd equal angular bins, measured
+   * from the major principal axis, and normalized to sum to one. Points are binned directly by
+   * angle so no sorting is needed, and the 2x2 covariance is decomposed in closed form.
+   *
+   * Reuses the buffers already held by result, so passing the same ContourData repeatedly
+   * does not allocate once it has grown to the largest contour. Changing its output requires
+   * bumping SIGNATURE_DESCRIPTOR.
+   */
   /// TODO: Fill the contour before doing mean/rotation ops
   int analyzeContour( _Contour const & input, ContourData & result, int nd )
   {
     /// TODO: Figure out exactly causes issues when data is this small
     if( input.size() <= 1)
       return -1;
-        
-    result = ContourData();
-    _Contour2f output_contour;
-    _Signature output_signature;
-    float rotation;
-    double max_radius;
-    /// mean is a 1x2 row vector, cov is a 2x2 symmetric matrix
-    cv::Mat mean(1, 2, CV_32F), cov(2,2, CV_32F), 
-      eigenvec, eigenval, sort_idx, contour_sorted;
-    
-    cv::Mat contour; cv::Mat(input).convertTo(contour, CV_32F);
-    contour = contour.reshape(1, 0); 
-    /// contour is now an nx2 vector where each row is a datapoint
-    
-    /**
-     * Absolutely need to set last arg to correct matrix type. This function 
-     * uses old C api and can't deduce type internally
-     */
-    cv::calcCovarMatrix( contour, cov, mean, 
-			 CV_COVAR_NORMAL + CV_COVAR_ROWS, CV_32F );
-
-    if ( !cv::eigen( cov, eigenval, eigenvec ) )
-      ROS_WARN("Eigendecomposition failed.");
-
-    /// so that column eigenvectors are in rows, making them easier to access.
-    cv::transpose( cov, cov );
-
-    ROS_DEBUG("Got eigenvals: %f, %f", eigenval.at<float>(0, 0), eigenval.at<float>(1,0));
-    ROS_DEBUG("Got eigenvectors: [%f, %f; %f, %f].",
-	     eigenvec.at<float>(0, 0), eigenvec.at<float>(0,1),
-	     eigenvec.at<float>(1, 0), eigenvec.at<float>(1,1));
-    
+
+    int const n = input.size();
+
+    /// mean, covariance, area and perimeter in a single pass
+    double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0, sum_yy = 0;
+    double twice_area = 0, perimeter = 0;
+    for( int idx = 0; idx < n; ++idx )
+      {
+	cv::Point2i const & point = input[ idx ];
+	cv::Point2i const & next = input[ ( idx + 1 ) % n ];
+	double const x = point.x, y = point.y;
+
+	sum_x += x; sum_y += y;
+	sum_xx += x * x; sum_xy += x * y; sum_yy += y * y;
+
+	twice_area += x * next.y - double( next.x ) * y;
+	perimeter += std::sqrt( double( next.x - point.x ) * ( next.x - point.x ) +
+				double( next.y - point.y ) * ( next.y - point.y ) );
+      }
+    double const mean_x = sum_x / n, mean_y = sum_y / n;
+
+    /// unscaled scatter matrix [a b; b c], as in CV_COVAR_NORMAL
+    double const a = sum_xx - sum_x * mean_x;
+    double const b = sum_xy - sum_x * mean_y;
+    double const c = sum_yy - sum_y * mean_y;
+
+    double const half_trace = 0.5 * ( a + c );
+    double const half_gap = std::sqrt( 0.25 * ( a - c ) * ( a - c ) + b * b );
+    double const major = half_trace + half_gap, minor = half_trace - half_gap;
+
+    /// eigenvector of the major eigenvalue, from whichever row of (cov - major*I) is better conditioned
+    double ev_x, ev_y;
+    if( a >= c ) { ev_x = major - c; ev_y = b; }
+    else         { ev_x = b;         ev_y = major - a; }
+    double const ev_norm = std::sqrt( ev_x * ev_x + ev_y * ev_y );
+    if( ev_norm > 0 ) { ev_x /= ev_norm; ev_y /= ev_norm; }
+    else              { ev_x = 1;        ev_y = 0; }
+
+    ROS_DEBUG("Got eigenvals: %f, %f", major, minor);
+    ROS_DEBUG("Got eigenvectors: [%f, %f; %f, %f].", ev_x, ev_y, -ev_y, ev_x);
+
     /// atan is on the interval [-pi/2, pi/2]
-    float* ev1 = eigenvec.ptr<float>(0);
-    rotation = atan(ev1[1]/ev1[0]);
+    float rotation = atan( float( ev_y ) / float( ev_x ) );
     rotation = rotation - uscauv::PI_TWO;
     if( rotation < -uscauv::PI_TWO )
       rotation = uscauv::PI + rotation;
     /// rotation is on [-pi/2, pi/2], with a rotation of zero indicating that biggest principal component is aligned with the y axis
 
-    /// center contour at zero
-    float* mean_ptr = mean.ptr<float>(0);
-    cv::subtract(contour.col(0), cv::Scalar(mean_ptr[0]), contour.col(0));
-    cv::subtract(contour.col(1), cv::Scalar(mean_ptr[1]), contour.col(1));
-
-    /// has consistently been 0,0
-    /* ROS_INFO("new mean: %f, %f", cv::mean(contour.col(0))[0], cv::mean(contour.col(1))[0] ); */
-
-    /// convert to polar form, with angle in the left col and radius in right
-    for(int idx = 0; idx < contour.rows; ++idx)
+    /// upper angle of each bin, matching the float thresholds the signature has always used
+    static thread_local std::vector<float> bin_ub;
+    static thread_local std::vector<double> bin_sum;
+    static thread_local std::vector<int> bin_count;
+    if( int( bin_ub.size() ) != nd )
       {
-	float* row = contour.ptr<float>(idx);
-	float theta = cv::fastAtan2( row[1], row[0] );
+	bin_ub.resize( nd );
+	for( int bin = 1; bin <= nd; ++bin )
+	  bin_ub[ bin - 1 ] = bin * 2*M_PI / nd;
+      }
+    bin_sum.assign( nd, 0.0 );
+    bin_count.assign( nd, 0 );
+
+    double const rotation_deg = rotation*180/M_PI;
+    float const cos_rotation = cos( rotation ), sin_rotation = sin( rotation );
+    /// Rounded like the CV_32F mean of calcCovarMatrix (a float sum scaled by float 1/n). Rounding the exact
+    /// mean instead is off by an ulp for about half of all contours, which moves points right at a bin edge.
+    float const inv_n = 1.0 / n;
+    float const mean_xf = float( sum_x ) * inv_n, mean_yf = float( sum_y ) * inv_n;
+    float const bins_per_radian = nd / uscauv::TWO_PI;
+
+    /// center at zero, bin by angle from the principal axis, and rotate the contour to zero for drawing later
+    float max_radius = 0;
+    result.contour_.resize( n );
+    for( int idx = 0; idx < n; ++idx )
+      {
+	float const x = input[ idx ].x - mean_xf, y = input[ idx ].y - mean_yf;
+
+	float theta = cv::fastAtan2( y, x );
 	/// rotate to zero
-	theta = theta - (rotation*180/M_PI); 
+	theta = theta - rotation_deg;
 	/// Make sure that theta stays in the range [0, 2pi]
 	theta = 
 	  ((theta < 0 ) ? 360 + theta: 
 	   (theta > 360 ) ? -360 + theta: 
 	   theta) * M_PI / 180;
-	float rad = sqrt(pow(row[0], 2) + pow(row[1], 2));
-	row[0] = theta; row[1] = rad;
+	float const rad = std::sqrt( double( x ) * x + double( y ) * y );
+	max_radius = std::max( max_radius, rad );
+
+	result.contour_[ idx ] = cv::Point2f( x * cos_rotation + y * sin_rotation,
+					      y * cos_rotation - x * sin_rotation );
+
+	/// first bin whose upper angle exceeds theta. The estimate is off by at most one from rounding.
+	int bin = std::min( std::max( int( theta * bins_per_radian ), 0 ), nd - 1 );
+	while( bin > 0 && theta < bin_ub[ bin - 1 ] )
+	  --bin;
+	while( bin < nd && !( theta < bin_ub[ bin ] ) )
+	  ++bin;
+	/// points right at 2pi fall past the last bin and have never been counted
+	if( bin == nd )
+	  continue;
+
+	bin_sum[ bin ] += rad;
+	++bin_count[ bin ];
       }
- 
-    /// get the radius of the bounding circle
-    cv::minMaxLoc( contour.col(1), NULL, &max_radius );
-    /// normalize radius to 1
-    contour.col(1) = (1.0f/max_radius) * contour.col(1);
-    
-    /// sort by angle, so that angle(0)=0, ..., angle(n)=360
-    contour_sorted = cv::Mat( contour.rows, contour.cols, CV_32F);
-    cv::sortIdx( contour.col(0), sort_idx, CV_SORT_EVERY_COLUMN + CV_SORT_ASCENDING );
-    int* sort = sort_idx.ptr<int>(0);
-    for(int idx = 0; idx < sort_idx.rows; ++idx)
-      {
-	/// funny syntax due to cv::Mat::row being sorta broken, see the documentation
-	contour.row( sort[idx] ).copyTo( contour_sorted.row( idx ));
-	/* ROS_INFO("%d->%d: Current theta: %f,%f", sort[idx], idx, contour.at<float>(idx,0), */
-	/* 	 contour_sorted.at<float>(idx, 0)); */
-      }
-    
-    /// Convert back to cartesian to create a contour that we will use to draw later
-    for(int idx = 0; idx < contour_sorted.rows; ++idx)
-      {
-	float* row = contour_sorted.ptr<float>(idx);
-	output_contour.push_back( cv::Point2f( row[1]*cos(row[0]), row[1]*sin(row[0])));
-      }    
 
-    /// create the final signature
-    int bin = 1;
-    int idx = 0;
-    while(bin <= nd )
+    if( !( max_radius > 0 ) )
+      return -1;
+
+    /// normalize the contour to a bounding radius of 1
+    float const inv_radius = 1.0f / max_radius;
+    for( int idx = 0; idx < n; ++idx )
+      result.contour_[ idx ] *= inv_radius;
+
+    /// create the final signature, and turn it into a pdf
+    double signature_sum = 0;
+    for( int bin = 0; bin < nd; ++bin )
       {
-	float ub = bin * 2*M_PI / nd;
-	float acc = 0.0f;
-	int n = 0;
-	/* DEBUG_SIZE( contour_sorted, "cs"); */
-	
-	while( contour_sorted.at<float>(idx,0) < ub && idx < contour_sorted.rows)
-	  {
-	    acc += contour_sorted.at<float>(idx,1);
-	    ++n;
-	    ++idx;
-	  }
-	float output = (n)? acc/n: 0;
-	output_signature.push_back(output);
-	
-	++bin;
+	bin_sum[ bin ] = bin_count[ bin ] ? bin_sum[ bin ] / bin_count[ bin ] : 0;
+	signature_sum += bin_sum[ bin ];
       }
-    /// Turn signature into pdf
-    cv::Scalar signature_sum = cv::sum( output_signature);
-    output_signature *= 1/signature_sum[0];
 
-    result.mean_      = cv::Point2f( mean_ptr[0], mean_ptr[1] );
-    result.eigenval_  = eigenval;
-    result.eigenvec_  = eigenvec;
+    result.signature_.create( nd, 1, CV_32F );
+    float * signature = result.signature_.ptr<float>(0);
+    for( int bin = 0; bin < nd; ++bin )
+      signature[ bin ] = bin_sum[ bin ] / signature_sum;
+
+    result.mean_      = cv::Point2f( mean_xf, mean_yf );
+    result.eigenval_  = cv::Vec2f( major, minor );
+    result.eigenvec_  = cv::Matx22f( ev_x, ev_y, -ev_y, ev_x );
     result.rotation_  = rotation;
     result.radius_    = max_radius;
-    result.contour_   = output_contour;
-    result.signature_ = output_signature;
+    result.area_      = 0.5 * std::fabs( twice_area );
+    result.invariants_ = uscauv::ShapeInvariants::compute( major, minor, result.area_, perimeter, max_radius );
 
     return 0;
   }
@@ -533,7 +873,7 @@ class ShapeMatcherNode: public BaseNode, public ImageTransceiver, public MultiRe
     /// draw the contour
     cv::drawContours(img, contours, 0, uscauv::CV_USCCARDINAL_BGR, 2);
     /// draw principal components
-    const float* evec = contour_data.eigenvec_.ptr<float>(0);
+    const float* evec = contour_data.eigenvec_.val;
     cv::Point2i e1( evec[0]*pc_size, evec[1]*pc_size), 
       e2( evec[2]*pc_size, evec[3]*pc_size);
 
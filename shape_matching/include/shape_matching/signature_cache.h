@@ -0,0 +1,295 @@
+/***************************************************************************
+ *  include/shape_matching/signature_cache.h
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_SHAPEMATCHING_SIGNATURECACHE
+#define USCAUV_SHAPEMATCHING_SIGNATURECACHE
+
+// cpp
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <sstream>
+#include <iomanip>
+
+/// opencv
+#include <opencv2/core/core.hpp>
+
+/// shape matching
+#include <shape_matching/contour_data.h>
+
+namespace uscauv
+{
+
+  /**
+   * 64-bit FNV-1a hash of an image's size, type and pixels.
+   */
+  inline uint64_t hashImage( cv::Mat const & image )
+  {
+    uint64_t hash = 14695981039346656037ULL;
+    auto const mix = [&hash]( unsigned char const * data, size_t const size )
+      {
+	for( size_t idx = 0; idx < size; ++idx )
+	  {
+	    hash ^= data[ idx ];
+	    hash *= 1099511628211ULL;
+	  }
+      };
+
+    int const header[] = { image.rows, image.cols, image.type() };
+    mix( reinterpret_cast<unsigned char const *>( header ), sizeof( header ) );
+
+    size_t const row_size = image.cols * image.elemSize();
+    for( int row = 0; row < image.rows; ++row )
+      mix( image.ptr<unsigned char>( row ), row_size );
+
+    return hash;
+  }
+
+  /// Everything a template signature is computed from
+  struct SignatureCacheKey
+  {
+    uint64_t image_hash_;
+    int signature_size_;
+    std::string descriptor_; /// descriptor type, analysis version and any other parameters that affect the signature
+
+    bool operator<( SignatureCacheKey const & other ) const
+    {
+      if( image_hash_ != other.image_hash_ )
+	return image_hash_ < other.image_hash_;
+      if( signature_size_ != other.signature_size_ )
+	return signature_size_ < other.signature_size_;
+      return descriptor_ < other.descriptor_;
+    }
+  };
+
+  /**
+   * Template signatures keyed by everything they are computed from, so that changing a parameter
+   * only recomputes templates whose inputs changed, and changing it back recomputes nothing.
+   * Optionally persisted to a single cv::FileStorage file so that startup can skip analysis too.
+   */
+  class SignatureCache
+  {
+  private:
+    typedef std::map<SignatureCacheKey, ContourData> _EntryMap;
+
+    _EntryMap entries_;
+    bool dirty_;
+
+  public:
+  SignatureCache(): dirty_( false ) {}
+
+    /// @return true on a hit
+    bool find( SignatureCacheKey const & key, ContourData & data ) const
+    {
+      _EntryMap::const_iterator entry_it = entries_.find( key );
+      if( entry_it == entries_.end() )
+	return false;
+
+      data = entry_it->second;
+      return true;
+    }
+
+    void insert( SignatureCacheKey const & key, ContourData const & data )
+    {
+      entries_[ key ] = data;
+      dirty_ = true;
+    }
+
+    /** 
+     * Drop every entry that keep returns false for, eg. ones computed by an older analysis or for
+     * templates that are no longer loaded, so that they aren't carried into the next save.
+     * 
+     * @param keep Called with each SignatureCacheKey
+     * @return Number of entries removed
+     */
+    template<class Keep>
+    size_t prune( Keep const & keep )
+    {
+      size_t removed = 0;
+      for( _EntryMap::iterator entry_it = entries_.begin(); entry_it != entries_.end(); )
+	{
+	  if( keep( entry_it->first ) )
+	    ++entry_it;
+	  else
+	    {
+	      entries_.erase( entry_it++ );
+	      ++removed;
+	    }
+	}
+
+      if( removed )
+	dirty_ = true;
+      return removed;
+    }
+
+    size_t size() const { return entries_.size(); }
+
+    /// Whether there are entries that haven't been saved
+    bool dirty() const { return dirty_; }
+
+    /** 
+     * Add the entries in a file written by save(). Malformed entries are skipped.
+     * 
+     * @return Number of entries loaded, or -1 if the file can't be opened
+     */
+    int load( std::string const & path )
+    {
+      cv::FileStorage file;
+      try
+	{
+	  if( !file.open( path, cv::FileStorage::READ ) )
+	    return -1;
+	}
+      catch( cv::Exception const & )
+	{
+	  return -1;
+	}
+
+      int loaded = 0;
+      cv::FileNode const entries = file[ "entries" ];
+      for( cv::FileNodeIterator entry_it = entries.begin(); entry_it != entries.end(); ++entry_it )
+	{
+	  cv::FileNode const & node = *entry_it;
+
+	  SignatureCacheKey key;
+	  std::string hash;
+	  node[ "hash" ] >> hash;
+	  std::stringstream hash_stream( hash );
+	  if( !( hash_stream >> std::hex >> key.image_hash_ ) )
+	    continue;
+	  node[ "signature_size" ] >> key.signature_size_;
+	  node[ "descriptor" ] >> key.descriptor_;
+
+	  ContourData data;
+	  std::vector<float> mean, eigenvec, eigenval;
+	  node[ "signature" ] >> data.signature_;
+	  node[ "contour" ] >> data.contour_;
+	  node[ "mean" ] >> mean;
+	  node[ "eigenvec" ] >> eigenvec;
+	  node[ "eigenval" ] >> eigenval;
+	  node[ "radius" ] >> data.radius_;
+	  node[ "enclosed_area" ] >> data.area_;
+	  node[ "rotation" ] >> data.rotation_;
+	  node[ "eccentricity" ] >> data.invariants_.eccentricity_;
+	  node[ "area" ] >> data.invariants_.area_;
+	  node[ "perimeter" ] >> data.invariants_.perimeter_;
+
+	  if( data.signature_.type() != CV_32FC1 || int( data.signature_.total() ) != key.signature_size_ ||
+	      mean.size() != 2 || eigenvec.size() != 4 || eigenval.size() != 2 )
+	    continue;
+
+	  data.mean_ = cv::Point2f( mean[0], mean[1] );
+	  data.eigenvec_ = cv::Matx22f( eigenvec[0], eigenvec[1], eigenvec[2], eigenvec[3] );
+	  data.eigenval_ = cv::Vec2f( eigenval[0], eigenval[1] );
+
+	  entries_[ key ] = data;
+	  ++loaded;
+	}
+
+      return loaded;
+    }
+
+    /** 
+     * Write every entry to path. The file is written to a temporary first, so a partially
+     * written cache is never loaded. ContourData::spectrum_ is derived from the signature and
+     * is not written.
+     * 
+     * @return 0 on success, -1 on failure
+     */
+    int save( std::string const & path )
+    {
+      std::string const temp_path = path + ".tmp.yaml";
+
+      try
+	{
+	  cv::FileStorage file( temp_path, cv::FileStorage::WRITE );
+	  if( !file.isOpened() )
+	    return -1;
+
+	  file << "entries" << "[";
+	  for( _EntryMap::const_iterator entry_it = entries_.begin(); entry_it != entries_.end(); ++entry_it )
+	    {
+	      SignatureCacheKey const & key = entry_it->first;
+	      ContourData const & data = entry_it->second;
+
+	      std::stringstream hash;
+	      hash << std::hex << std::setw( 16 ) << std::setfill( '0' ) << key.image_hash_;
+
+	      std::vector<float> const mean = { data.mean_.x, data.mean_.y };
+	      std::vector<float> const eigenvec( data.eigenvec_.val, data.eigenvec_.val + 4 );
+	      std::vector<float> const eigenval = { data.eigenval_[0], data.eigenval_[1] };
+
+	      file << "{"
+		   << "hash" << hash.str()
+		   << "signature_size" << key.signature_size_
+		   << "descriptor" << key.descriptor_
+		   << "signature" << data.signature_
+		   << "contour" << data.contour_
+		   << "mean" << mean
+		   << "eigenvec" << eigenvec
+		   << "eigenval" << eigenval
+		   << "radius" << data.radius_
+		   << "enclosed_area" << data.area_
+		   << "rotation" << data.rotation_
+		   << "eccentricity" << data.invariants_.eccentricity_
+		   << "area" << data.invariants_.area_
+		   << "perimeter" << data.invariants_.perimeter_
+		   << "}";
+	    }
+	  file << "]";
+	  file.release();
+	}
+      catch( cv::Exception const & )
+	{
+	  std::remove( temp_path.c_str() );
+	  return -1;
+	}
+
+      if( std::rename( temp_path.c_str(), path.c_str() ) )
+	{
+	  std::remove( temp_path.c_str() );
+	  return -1;
+	}
+
+      dirty_ = false;
+      return 0;
+    }
+  };
+
+} // uscauv
+
+#endif // USCAUV_SHAPEMATCHING_SIGNATURECACHE
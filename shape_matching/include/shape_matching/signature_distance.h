@@ -0,0 +1,154 @@
+/***************************************************************************
+ *  include/shape_matching/signature_distance.h
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_SHAPEMATCHING_SIGNATUREDISTANCE
+#define USCAUV_SHAPEMATCHING_SIGNATUREDISTANCE
+
+// cpp
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+/// opencv
+#include <opencv2/core/core.hpp>
+
+namespace uscauv
+{
+
+  /**
+   * Closed-form circular EMD from the cumulative differences F of two histograms of equal mass:
+   * sum_i |F_i - median(F)| (Werman, Peleg & Rosenfeld).
+   *
+   * @param sorted Scratch space for size values
+   */
+  inline double circularEMDFromCumulative( double const * cumulative, int const size, double * sorted )
+  {
+    if( size <= 0 )
+      return 0;
+
+    std::copy( cumulative, cumulative + size, sorted );
+
+    /// Any point between the two middle values minimizes the sum, so nth_element is sufficient
+    std::nth_element( sorted, sorted + size / 2, sorted + size );
+    double const median = sorted[ size / 2 ];
+
+    double work = 0;
+    for( int idx = 0; idx < size; ++idx )
+      work += std::fabs( cumulative[ idx ] - median );
+
+    return work;
+  }
+
+  /**
+   * Earth mover's distance between two circular histograms of equal mass,
+   * using the circular bin distance min(|i-j|, n-|i-j|) as ground cost.
+   *
+   * For this case the transportation problem has a closed form (see circularEMDFromCumulative).
+   * This is the value cv::EMD returns for unit-mass signatures with the cost matrix from
+   * ShapeMatcherNode::circularCostEuclidian, in O(n) instead of a full LP solve.
+   *
+   * @param scratch Scratch buffer, resized to 2*size. Holds the cumulative sums and a copy for selection.
+   */
+  inline double circularEMD( float const * first, float const * second, int const size,
+			     std::vector<double> & scratch )
+  {
+    if( size <= 0 )
+      return 0;
+
+    scratch.resize( 2 * size );
+    double * const cumulative = scratch.data();
+
+    double running = 0;
+    for( int idx = 0; idx < size; ++idx )
+      {
+	running += double( first[ idx ] ) - double( second[ idx ] );
+	cumulative[ idx ] = running;
+      }
+
+    return circularEMDFromCumulative( cumulative, size, cumulative + size );
+  }
+
+  /**
+   * Signatures are single-channel CV_32F vectors (row or column) of the same length,
+   * normalized to sum to one.
+   */
+  inline double circularEMD( cv::Mat const & first, cv::Mat const & second )
+  {
+    CV_Assert( first.type() == CV_32FC1 && second.type() == CV_32FC1 );
+    CV_Assert( first.total() == second.total() );
+    CV_Assert( first.isContinuous() && second.isContinuous() );
+
+    static thread_local std::vector<double> scratch;
+
+    return circularEMD( first.ptr<float>(0), second.ptr<float>(0), int( first.total() ), scratch );
+  }
+
+  /**
+   * Lower bound on circularEMD that skips the median selection. Every unit of mass that moves
+   * travels at least one bin, so the work is at least half the L1 distance; and since the
+   * median lies between the extremes of F, the work is also at least max(F) - min(F).
+   */
+  inline double circularEMDLowerBound( float const * first, float const * second, int const size )
+  {
+    if( size <= 0 )
+      return 0;
+
+    double running = 0, lowest = 0, highest = 0, l1 = 0;
+    for( int idx = 0; idx < size; ++idx )
+      {
+	double const diff = double( first[ idx ] ) - double( second[ idx ] );
+	l1 += std::fabs( diff );
+	running += diff;
+
+	lowest = idx ? std::min( lowest, running ) : running;
+	highest = idx ? std::max( highest, running ) : running;
+      }
+
+    return std::max( 0.5 * l1, highest - lowest );
+  }
+
+  inline double circularEMDLowerBound( cv::Mat const & first, cv::Mat const & second )
+  {
+    CV_Assert( first.type() == CV_32FC1 && second.type() == CV_32FC1 );
+    CV_Assert( first.total() == second.total() );
+    CV_Assert( first.isContinuous() && second.isContinuous() );
+
+    return circularEMDLowerBound( first.ptr<float>(0), second.ptr<float>(0), int( first.total() ) );
+  }
+
+} // uscauv
+
+#endif // USCAUV_SHAPEMATCHING_SIGNATUREDISTANCE
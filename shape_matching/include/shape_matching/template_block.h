@@ -0,0 +1,225 @@
+/***************************************************************************
+ *  include/shape_matching/template_block.h
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_SHAPEMATCHING_TEMPLATEBLOCK
+#define USCAUV_SHAPEMATCHING_TEMPLATEBLOCK
+
+// cpp
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+
+/// opencv
+#include <opencv2/core/core.hpp>
+
+/// shape matching
+#include <shape_matching/signature_distance.h>
+
+namespace uscauv
+{
+
+  /**
+   * Template signatures packed bin-major into one contiguous block, so that one contour signature
+   * is compared against every template with loops over fixed-size groups of templates that the
+   * compiler vectorizes. Scores are bitwise identical to circularEMD() and circularEMDLowerBound().
+   *
+   * The sweep computes the cumulative differences and lower bound of every template at once. Only the
+   * median selection of the exact distance is done per template, since a vectorized selection
+   * (rank counting) is O(bins^2) and only breaks even with 256-bit vectors.
+   */
+  class TemplateBlock
+  {
+  public:
+    /// Templates per group. Every per-template loop runs over exactly this many lanes.
+    static size_t const LANES = 8;
+
+    /// Per-thread scratch space for sweep() and score()
+    struct Workspace
+    {
+      /// cumulative differences, bins x stride
+      std::vector<double> cumulative_;
+      /// lower bound of every template, stride entries
+      std::vector<double> lower_;
+      std::vector<size_t> survivors_;
+      std::vector<double> exact_, work_;
+    };
+
+  private:
+    int bins_;
+    size_t count_;
+    /// templates per bin row, padded to a multiple of LANES and grown geometrically
+    size_t stride_;
+    /// values_[ bin * stride_ + template ], zero in the padding
+    std::vector<double> values_;
+
+  public:
+  TemplateBlock(): bins_( 0 ), count_( 0 ), stride_( 0 ) {}
+
+    void clear()
+    {
+      bins_ = 0;
+      count_ = 0;
+      stride_ = 0;
+      values_.clear();
+    }
+
+    int bins() const { return bins_; }
+    size_t size() const { return count_; }
+    size_t stride() const { return stride_; }
+
+    /// Append a template signature. All signatures must be CV_32FC1 and the same length.
+    void add( cv::Mat const & signature )
+    {
+      CV_Assert( signature.type() == CV_32FC1 && signature.isContinuous() );
+      CV_Assert( !count_ || int( signature.total() ) == bins_ );
+
+      bins_ = signature.total();
+      if( count_ == stride_ )
+	{
+	  size_t const stride = stride_ ? 2 * stride_ : LANES;
+	  std::vector<double> values( bins_ * stride, 0.0 );
+	  for( int bin = 0; bin < bins_; ++bin )
+	    std::copy( values_.begin() + bin * stride_, values_.begin() + bin * stride_ + count_,
+		       values.begin() + bin * stride );
+	  values_.swap( values );
+	  stride_ = stride;
+	}
+
+      float const * data = signature.ptr<float>(0);
+      for( int bin = 0; bin < bins_; ++bin )
+	values_[ bin * stride_ + count_ ] = data[ bin ];
+      ++count_;
+    }
+
+    /**
+     * Cumulative differences and circularEMDLowerBound() of a contour signature against every template.
+     * Results are in workspace.cumulative_ and workspace.lower_, including the padding lanes.
+     */
+    void sweep( float const * signature, Workspace & workspace ) const
+    {
+      size_t const stride = stride_;
+      workspace.cumulative_.resize( bins_ * stride );
+      workspace.lower_.resize( stride );
+
+      for( size_t group = 0; group < stride; group += LANES )
+	{
+	  /// Accumulate in locals so that the loops don't need runtime alias checks to vectorize
+	  double running[ LANES ], l1[ LANES ], lowest[ LANES ], highest[ LANES ];
+	  for( size_t lane = 0; lane < LANES; ++lane )
+	    {
+	      running[ lane ] = 0;
+	      l1[ lane ] = 0;
+	      lowest[ lane ] = std::numeric_limits<double>::infinity();
+	      highest[ lane ] = -std::numeric_limits<double>::infinity();
+	    }
+
+	  for( int bin = 0; bin < bins_; ++bin )
+	    {
+	      double const value = signature[ bin ];
+	      double const * const templates = values_.data() + bin * stride + group;
+	      for( size_t lane = 0; lane < LANES; ++lane )
+		{
+		  double const diff = value - templates[ lane ];
+		  running[ lane ] += diff;
+		  l1[ lane ] += std::fabs( diff );
+		  lowest[ lane ] = std::min( lowest[ lane ], running[ lane ] );
+		  highest[ lane ] = std::max( highest[ lane ], running[ lane ] );
+		}
+
+	      double * const cumulative = workspace.cumulative_.data() + bin * stride + group;
+	      for( size_t lane = 0; lane < LANES; ++lane )
+		cumulative[ lane ] = running[ lane ];
+	    }
+
+	  double * const lower = workspace.lower_.data() + group;
+	  for( size_t lane = 0; lane < LANES; ++lane )
+	    lower[ lane ] = std::max( 0.5 * l1[ lane ], highest[ lane ] - lowest[ lane ] );
+	}
+    }
+
+    /**
+     * circularEMD() against a subset of the templates, from the results of the last sweep().
+     *
+     * @param indices Templates to score
+     * @param scores Output, one per index
+     */
+    void exact( size_t const * indices, size_t const count, Workspace & workspace, double * scores ) const
+    {
+      workspace.work_.resize( 2 * bins_ );
+      double * const column = workspace.work_.data();
+      for( size_t idx = 0; idx < count; ++idx )
+	{
+	  double const * const cumulative = workspace.cumulative_.data() + indices[ idx ];
+	  for( int bin = 0; bin < bins_; ++bin )
+	    column[ bin ] = cumulative[ bin * stride_ ];
+	  scores[ idx ] = circularEMDFromCumulative( column, bins_, column + bins_ );
+	}
+    }
+
+    /**
+     * One row of the contour x template score matrix. Templates whose lower bound is at least
+     * boundary get the bound instead of the exact distance, since they can't match anyway.
+     *
+     * @param scores Output, one per template
+     * @return Number of exact distances computed
+     */
+    size_t score( float const * signature, double const boundary, double * scores, Workspace & workspace ) const
+    {
+      sweep( signature, workspace );
+
+      std::vector<size_t> & survivors = workspace.survivors_;
+      survivors.clear();
+      for( size_t idx = 0; idx < count_; ++idx )
+	{
+	  scores[ idx ] = workspace.lower_[ idx ];
+	  if( workspace.lower_[ idx ] < boundary )
+	    survivors.push_back( idx );
+	}
+
+      std::vector<double> & exact_scores = workspace.exact_;
+      exact_scores.resize( survivors.size() );
+      exact( survivors.data(), survivors.size(), workspace, exact_scores.data() );
+      for( size_t idx = 0; idx < survivors.size(); ++idx )
+	scores[ survivors[ idx ] ] = exact_scores[ idx ];
+
+      return survivors.size();
+    }
+  };
+
+} // uscauv
+
+#endif // USCAUV_SHAPEMATCHING_TEMPLATEBLOCK
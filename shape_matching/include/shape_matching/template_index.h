@@ -0,0 +1,293 @@
+/***************************************************************************
+ *  include/shape_matching/template_index.h
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_SHAPEMATCHING_TEMPLATEINDEX
+#define USCAUV_SHAPEMATCHING_TEMPLATEINDEX
+
+// cpp
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+/// opencv
+#include <opencv2/core/core.hpp>
+
+/// shape matching
+#include <shape_matching/signature_distance.h>
+#include <shape_matching/template_block.h>
+
+namespace uscauv
+{
+
+  /**
+   * Scale and rotation invariant descriptors of a contour that are cheap to compare.
+   */
+  struct ShapeInvariants
+  {
+    double eccentricity_; /// 1 - minor/major PCA eigenvalue, on [0, 1]
+    double area_;         /// contour area / bounding radius^2
+    double perimeter_;    /// contour perimeter / bounding radius
+
+  ShapeInvariants(): eccentricity_(0), area_(0), perimeter_(0) {}
+
+    /**
+     * @param major, minor PCA eigenvalues of the contour points
+     * @param radius Radius of the bounding circle about the contour mean
+     */
+    static ShapeInvariants compute( double major, double minor, double area, double perimeter, double radius )
+    {
+      ShapeInvariants invariants;
+      if( major < minor )
+	std::swap( major, minor );
+
+      invariants.eccentricity_ = ( major > 0 ) ? 1.0 - std::max( minor, 0.0 ) / major : 0;
+      invariants.area_ = ( radius > 0 ) ? area / ( radius * radius ) : 0;
+      invariants.perimeter_ = ( radius > 0 ) ? perimeter / radius : 0;
+      return invariants;
+    }
+  };
+
+  /**
+   * Tolerances for the invariant stages of TemplateIndex. A tolerance of zero disables its stage.
+   * These are heuristics with no relationship to the EMD, so matches are only guaranteed to be
+   * identical to exhaustive scoring when all of them are disabled.
+   */
+  struct TemplateIndexTolerance
+  {
+    double eccentricity_; /// max absolute eccentricity difference
+    double area_;         /// max relative area ratio, ie. larger/smaller - 1
+    double perimeter_;    /// max relative perimeter ratio
+    bool use_bound_;      /// reject with circularEMDLowerBound (exact)
+
+  TemplateIndexTolerance(): eccentricity_(0), area_(0), perimeter_(0), use_bound_(true) {}
+  };
+
+  /// Running totals of where contour/template pairs were rejected
+  struct TemplateIndexStats
+  {
+    size_t pairs_;
+    size_t eccentricity_rejects_;
+    size_t area_rejects_;
+    size_t perimeter_rejects_;
+    size_t bound_rejects_;
+    size_t scored_;
+
+  TemplateIndexStats(): pairs_(0), eccentricity_rejects_(0), area_rejects_(0),
+      perimeter_rejects_(0), bound_rejects_(0), scored_(0) {}
+
+    TemplateIndexStats & operator+=( TemplateIndexStats const & other )
+    {
+      pairs_ += other.pairs_;
+      eccentricity_rejects_ += other.eccentricity_rejects_;
+      area_rejects_ += other.area_rejects_;
+      perimeter_rejects_ += other.perimeter_rejects_;
+      bound_rejects_ += other.bound_rejects_;
+      scored_ += other.scored_;
+      return *this;
+    }
+  };
+
+  /**
+   * Holds template signatures and invariants, and filters contour/template pairs through
+   * progressively more expensive stages so that only survivors are scored with the full EMD.
+   *
+   * Templates are queried in the order in which they were added. Queries don't modify the index,
+   * so they can run concurrently as long as each thread keeps its own stats.
+   *
+   * Signatures are also packed into a TemplateBlock, so that the closed-form query computes the
+   * bound for every template in one vectorized sweep and scores the survivors as a batch.
+   */
+  class TemplateIndex
+  {
+  public:
+    struct Entry
+    {
+      std::string name_;
+      cv::Mat signature_;
+      ShapeInvariants invariants_;
+    };
+
+    typedef std::vector<Entry>::const_iterator const_iterator;
+
+  private:
+    /// Absorbs rounding between the bound and the closed-form EMD, and the float error of cv::EMD
+    static constexpr double BOUND_SLACK = 1e-5;
+
+    std::vector<Entry> entries_;
+    TemplateBlock block_;
+    TemplateIndexTolerance tolerance_;
+
+  public:
+    void clear()
+    {
+      entries_.clear();
+      block_.clear();
+    }
+
+    void add( std::string const & name, cv::Mat const & signature, ShapeInvariants const & invariants )
+    {
+      Entry entry;
+      entry.name_ = name;
+      entry.signature_ = signature;
+      entry.invariants_ = invariants;
+      entries_.push_back( entry );
+      block_.add( signature );
+    }
+
+    void setTolerance( TemplateIndexTolerance const & tolerance ) { tolerance_ = tolerance; }
+    TemplateIndexTolerance const & tolerance() const { return tolerance_; }
+
+    size_t size() const { return entries_.size(); }
+    const_iterator begin() const { return entries_.begin(); }
+    const_iterator end() const { return entries_.end(); }
+    TemplateBlock const & block() const { return block_; }
+
+    /**
+     * Score a contour against every template that survives the filter stages.
+     *
+     * @param score Callable as double( cv::Mat const & contour_signature, cv::Mat const & template_signature ).
+     * Must return a distance bounded below by circularEMDLowerBound if use_bound_ is set.
+     * @param visit Callable as void( Entry const &, double distance ) for each template with distance < boundary.
+     * @param stats Reject counts are added to this.
+     */
+    template<class Score, class Visit>
+      void query( cv::Mat const & signature, ShapeInvariants const & invariants, double const boundary,
+		  Score score, Visit visit, TemplateIndexStats & stats ) const
+      {
+	for( const_iterator entry_it = entries_.begin(); entry_it != entries_.end(); ++entry_it )
+	  {
+	    ++stats.pairs_;
+	    if( !passInvariants( invariants, entry_it->invariants_, stats ) )
+	      continue;
+
+	    if( tolerance_.use_bound_ &&
+		circularEMDLowerBound( signature, entry_it->signature_ ) >= boundary + BOUND_SLACK )
+	      {
+		++stats.bound_rejects_;
+		continue;
+	      }
+
+	    ++stats.scored_;
+	    double const distance = score( signature, entry_it->signature_ );
+	    if( distance < boundary )
+	      visit( *entry_it, distance );
+	  }
+      }
+
+    /**
+     * Same as above, scoring survivors with circularEMD() through the template block.
+     * Distances, visit order and stats are identical to passing circularEMD as the score.
+     */
+    template<class Visit>
+      void query( cv::Mat const & signature, ShapeInvariants const & invariants, double const boundary,
+		  Visit visit, TemplateIndexStats & stats ) const
+      {
+	if( entries_.empty() )
+	  return;
+
+	CV_Assert( signature.type() == CV_32FC1 && signature.isContinuous() &&
+		   int( signature.total() ) == block_.bins() );
+
+	static thread_local TemplateBlock::Workspace workspace;
+	block_.sweep( signature.ptr<float>(0), workspace );
+
+	std::vector<size_t> & survivors = workspace.survivors_;
+	survivors.clear();
+	for( size_t idx = 0; idx < entries_.size(); ++idx )
+	  {
+	    ++stats.pairs_;
+	    if( !passInvariants( invariants, entries_[ idx ].invariants_, stats ) )
+	      continue;
+
+	    if( tolerance_.use_bound_ && workspace.lower_[ idx ] >= boundary + BOUND_SLACK )
+	      {
+		++stats.bound_rejects_;
+		continue;
+	      }
+
+	    survivors.push_back( idx );
+	  }
+
+	stats.scored_ += survivors.size();
+	std::vector<double> & distances = workspace.exact_;
+	distances.resize( survivors.size() );
+	block_.exact( survivors.data(), survivors.size(), workspace, distances.data() );
+
+	for( size_t idx = 0; idx < survivors.size(); ++idx )
+	  if( distances[ idx ] < boundary )
+	    visit( entries_[ survivors[ idx ] ], distances[ idx ] );
+      }
+
+  private:
+    /// The invariant stages, in order. Counts the stage that rejects the pair, if any.
+    bool passInvariants( ShapeInvariants const & invariants, ShapeInvariants const & other,
+			 TemplateIndexStats & stats ) const
+    {
+      if( tolerance_.eccentricity_ > 0 &&
+	  std::fabs( invariants.eccentricity_ - other.eccentricity_ ) > tolerance_.eccentricity_ )
+	{
+	  ++stats.eccentricity_rejects_;
+	  return false;
+	}
+
+      if( tolerance_.area_ > 0 && !withinRatio( invariants.area_, other.area_, tolerance_.area_ ) )
+	{
+	  ++stats.area_rejects_;
+	  return false;
+	}
+
+      if( tolerance_.perimeter_ > 0 &&
+	  !withinRatio( invariants.perimeter_, other.perimeter_, tolerance_.perimeter_ ) )
+	{
+	  ++stats.perimeter_rejects_;
+	  return false;
+	}
+
+      return true;
+    }
+
+    static bool withinRatio( double first, double second, double const tolerance )
+    {
+      if( first < second )
+	std::swap( first, second );
+      return first <= second * ( 1.0 + tolerance );
+    }
+  };
+
+} // uscauv
+
+#endif // USCAUV_SHAPEMATCHING_TEMPLATEINDEX
@@ -0,0 +1,309 @@
+/***************************************************************************
+ *  src/matching_benchmark.cpp
+ *  --------------------
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+/// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+/// cpp11
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <random>
+
+/// shape_matching
+#include <shape_matching/signature_distance.h>
+#include <shape_matching/template_block.h>
+#include <shape_matching/fourier_descriptor.h>
+
+/// Benchmark setup ------------------------------------
+
+const std::string keys =
+  "{    h| help          |false                      | Print this message.                                    }"
+  "{    t| templates     |1,10,100,1000              | Comma-separated list of template counts                }"
+  "{    m| modes         |scalar,block,pruned,fourier | Comma-separated list of modes (scalar, block, pruned, fourier, lp) }"
+  "{    s| signature-size|20                         | Bins per radial signature                              }"
+  "{    c| contours      |2000                       | Contour signatures to score against every template     }"
+  "{    b| boundary      |0.15                       | emd_boundary for the pruned mode                       }"
+  "{    f| format        |json                       | Output format (json, csv)                              }"
+  "{    o| output        |-                          | Output file, or - for stdout                           }"
+  ;
+
+std::vector<std::string> splitList( std::string const & list )
+{
+  std::vector<std::string> items;
+  std::stringstream stream( list );
+  std::string item;
+  while( std::getline( stream, item, ',' ) )
+    if( !item.empty() )
+      items.push_back( item );
+  return items;
+}
+
+/// A smooth radial signature of unit mass, like the ones analyzeContour produces for real shapes
+void generateSignature( std::mt19937 & rng, int const size, cv::Mat & signature )
+{
+  std::uniform_real_distribution<float> uniform( 0, 1 );
+  signature.create( size, 1, CV_32FC1 );
+  float const phase = 2 * M_PI * uniform( rng );
+  int const lobes = 1 + rng() % 4;
+  float const depth = 0.8f * uniform( rng );
+
+  for( int bin = 0; bin < size; ++bin )
+    signature.at<float>( bin ) = 1.0f + depth * std::cos( lobes * 2 * M_PI * bin / size + phase );
+  signature /= cv::sum( signature )[0];
+}
+
+/// A template seen through some noise, so that a realistic fraction of pairs is within the boundary
+void perturbSignature( std::mt19937 & rng, cv::Mat const & source, float const noise, cv::Mat & signature )
+{
+  std::uniform_real_distribution<float> uniform( 1.0f - noise, 1.0f + noise );
+  source.copyTo( signature );
+  for( int bin = 0; bin < signature.rows; ++bin )
+    signature.at<float>( bin ) *= uniform( rng );
+  signature /= cv::sum( signature )[0];
+}
+
+/// Same as ShapeMatcherNode::circularCostEuclidian
+void circularCost( int const size, cv::Mat & cost )
+{
+  cost.create( size, size, CV_32FC1 );
+  for( int row = 0; row < size; ++row )
+    for( int col = 0; col < size; ++col )
+      {
+	int const distance = std::abs( row - col );
+	cost.at<float>( row, col ) = std::min( distance, size - distance );
+      }
+}
+
+struct Result
+{
+  std::string mode_;
+  size_t templates_, contours_;
+  int signature_size_;
+  double pairs_per_second_;
+  /// fraction of pairs that got an exact distance
+  double scored_fraction_;
+  size_t matches_;
+  /// largest difference to circularEMD over all pairs with exact distances
+  double max_error_;
+};
+
+typedef std::chrono::steady_clock _Clock;
+
+/**
+ * Score every contour against every template. scalar and lp compute one pair at a time, block fills
+ * the whole contours x templates matrix through a TemplateBlock, and pruned does the same but only
+ * computes exact distances for templates whose lower bound is within the boundary. fourier computes
+ * the contour's magnitude spectrum and its distance to every template spectrum, which measures the
+ * cost of matching but not the same distance, so it is not verified and reports no matches.
+ */
+Result runBenchmark( std::string const & mode, std::vector<cv::Mat> const & templates, std::vector<cv::Mat> const & contours,
+		     double const boundary )
+{
+  Result result;
+  result.mode_ = mode;
+  result.templates_ = templates.size();
+  result.contours_ = contours.size();
+  result.signature_size_ = templates.front().rows;
+  result.scored_fraction_ = 1.0;
+  result.matches_ = 0;
+  result.max_error_ = 0;
+
+  uscauv::TemplateBlock block;
+  for( cv::Mat const & signature : templates )
+    block.add( signature );
+
+  cv::Mat cost;
+  circularCost( result.signature_size_, cost );
+
+  /// Template spectra are computed when templates are loaded, so they aren't timed
+  std::vector<cv::Mat> spectra( mode == "fourier" ? templates.size() : 0 );
+  for( size_t idx = 0; idx < spectra.size(); ++idx )
+    uscauv::fourierMagnitudes( templates[ idx ], spectra[ idx ] );
+  cv::Mat spectrum;
+
+  /// The LP solver is orders of magnitude slower, so it only sees a sample of the contours
+  size_t const contour_count = mode == "lp" ? std::max<size_t>( contours.size() / 100, 1 ) : contours.size();
+  result.contours_ = contour_count;
+
+  std::vector<double> scores( contour_count * templates.size() );
+  uscauv::TemplateBlock::Workspace workspace;
+  size_t scored = 0;
+
+  _Clock::time_point const start = _Clock::now();
+
+  for( size_t contour = 0; contour < contour_count; ++contour )
+    {
+      double * const row = scores.data() + contour * templates.size();
+      if( mode == "scalar" )
+	for( size_t idx = 0; idx < templates.size(); ++idx )
+	  row[ idx ] = uscauv::circularEMD( contours[ contour ], templates[ idx ] );
+      else if( mode == "fourier" )
+	{
+	  uscauv::fourierMagnitudes( contours[ contour ], spectrum );
+	  for( size_t idx = 0; idx < templates.size(); ++idx )
+	    row[ idx ] = uscauv::spectrumDistance( spectrum, spectra[ idx ] );
+	}
+      else if( mode == "lp" )
+	for( size_t idx = 0; idx < templates.size(); ++idx )
+	  row[ idx ] = cv::EMD( contours[ contour ], templates[ idx ], CV_DIST_USER, cost );
+      else
+	{
+	  double const row_boundary = mode == "pruned" ? boundary : std::numeric_limits<double>::infinity();
+	  scored += block.score( contours[ contour ].ptr<float>(0), row_boundary, row, workspace );
+	}
+    }
+
+  double const seconds = std::chrono::duration<double>( _Clock::now() - start ).count();
+  double const pairs = double( contour_count ) * templates.size();
+  result.pairs_per_second_ = seconds > 0 ? pairs / seconds : 0.0;
+  if( mode == "block" || mode == "pruned" )
+    result.scored_fraction_ = scored / pairs;
+
+  if( mode == "fourier" )
+    return result;
+
+  /// Verify against the scalar distance outside of the timed loop
+  for( size_t contour = 0; contour < contour_count; ++contour )
+    for( size_t idx = 0; idx < templates.size(); ++idx )
+      {
+	double const score = scores[ contour * templates.size() + idx ];
+	double const expected = uscauv::circularEMD( contours[ contour ], templates[ idx ] );
+	if( score < boundary )
+	  ++result.matches_;
+	if( mode != "pruned" || expected < boundary )
+	  result.max_error_ = std::max( result.max_error_, std::fabs( score - expected ) );
+      }
+
+  return result;
+}
+
+void writeJson( std::ostream & out, std::vector<Result> const & results )
+{
+  out << "{\n  \"results\": [\n";
+  for( size_t idx = 0; idx < results.size(); ++idx )
+    {
+      Result const & result = results[ idx ];
+      out << "    { \"mode\": \"" << result.mode_ << "\", \"templates\": " << result.templates_
+	  << ", \"contours\": " << result.contours_ << ", \"signature_size\": " << result.signature_size_
+	  << ", \"pairs_per_second\": " << result.pairs_per_second_ << ", \"scored_fraction\": " << result.scored_fraction_
+	  << ", \"matches\": " << result.matches_ << ", \"max_error\": " << result.max_error_ << " }"
+	  << ( idx + 1 < results.size() ? "," : "" ) << "\n";
+    }
+  out << "  ]\n}\n";
+}
+
+void writeCsv( std::ostream & out, std::vector<Result> const & results )
+{
+  out << "mode,templates,contours,signature_size,pairs_per_second,scored_fraction,matches,max_error\n";
+  for( Result const & result : results )
+    out << result.mode_ << "," << result.templates_ << "," << result.contours_ << "," << result.signature_size_ << ","
+	<< result.pairs_per_second_ << "," << result.scored_fraction_ << "," << result.matches_ << "," << result.max_error_ << "\n";
+}
+
+int main(int argc, const char ** argv)
+{
+  cv::CommandLineParser parser( argc, argv, keys.c_str() );
+
+  if ( parser.get<bool>("help") )
+    {
+      std::cout << "usage: " << argv[0] << " [--templates=1,10,100,1000] [--format=csv] [--output=results.csv]" << std::endl;
+      parser.printParams();
+      return 0;
+    }
+
+  std::string const format = parser.get<std::string>("format");
+  std::string const output_path = parser.get<std::string>("output");
+  int const signature_size = std::max( parser.get<int>("signature-size"), 2 );
+  size_t const contour_count = std::max( parser.get<int>("contours"), 1 );
+  double const boundary = parser.get<double>("boundary");
+
+  std::vector<size_t> template_counts;
+  for( std::string const & count : splitList( parser.get<std::string>("templates") ) )
+    template_counts.push_back( std::max( atoi( count.c_str() ), 1 ) );
+
+  std::vector<std::string> const modes = splitList( parser.get<std::string>("modes") );
+
+  /// Run ------------------------------------
+  std::vector<Result> results;
+  std::mt19937 rng( signature_size );
+
+  for( size_t const template_count : template_counts )
+    {
+      std::vector<cv::Mat> templates( template_count ), contours( contour_count );
+      for( cv::Mat & signature : templates )
+	generateSignature( rng, signature_size, signature );
+
+      /// Half of the contours are noisy views of a template, the rest are unrelated shapes
+      for( size_t idx = 0; idx < contour_count; ++idx )
+	if( idx % 2 )
+	  perturbSignature( rng, templates[ rng() % template_count ], 0.2f, contours[ idx ] );
+	else
+	  generateSignature( rng, signature_size, contours[ idx ] );
+
+      for( std::string const & mode : modes )
+	{
+	  std::cerr << "[ " << mode << " ] [ " << template_count << " templates ]" << std::endl;
+	  results.push_back( runBenchmark( mode, templates, contours, boundary ) );
+	}
+    }
+
+  std::ofstream file;
+  if( output_path != "-" )
+    {
+      file.open( output_path.c_str() );
+      if( !file )
+	{
+	  std::cerr << "Failed to open output file [ " << output_path << " ]." << std::endl;
+	  return 1;
+	}
+    }
+  std::ostream & out = output_path != "-" ? file : std::cout;
+
+  if( format == "csv" )
+    writeCsv( out, results );
+  else
+    writeJson( out, results );
+
+  return 0;
+}
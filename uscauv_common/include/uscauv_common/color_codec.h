@@ -50,43 +50,191 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <auv_msgs/ColorEncodedImage.h>
 
+// cpp11
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// uscauv
+#include <uscauv_common/color_plane.h>
+
 namespace uscauv
 {
-  static char const * const COLOR_CODEC_IMAGE_TYPE = "mono16";
+  /**
+   * Per-color masks of a received color plane. The plane shares the message's buffer, and each color's
+   * mask is only extracted the first time that it is accessed, so colors that nobody looks at cost nothing.
+   * Iterating visits the color names in encoding order. Safe to access from several threads at once, and
+   * different colors are extracted concurrently.
+   */
+  class ColorImageMap
+  {
+  public:
+    typedef std::vector<std::string>::const_iterator const_iterator;
+
+  private:
+    cv::Mat plane_;
+    /// Owns the buffer behind plane_, if plane_ doesn't own it itself
+    boost::shared_ptr<void const> tracked_object_;
+    std::vector<std::string> names_;
+    std::map<std::string, unsigned int> bits_;
+
+    /// One per color, so that extracting one color never waits for another
+    mutable std::vector<std::once_flag> extracted_;
+    mutable std::vector<cv::Mat> masks_;
+
+  public:
+    /** 
+     * @param plane Color plane. Not copied, so it must not be modified afterwards.
+     * @param names Name of each color, in bit order
+     * @param tracked_object Kept alive as long as this object, e.g. the message that plane points into
+     */
+    ColorImageMap( cv::Mat const & plane, std::vector<std::string> const & names,
+		   boost::shared_ptr<void const> const & tracked_object = boost::shared_ptr<void const>() ):
+      plane_( plane ), tracked_object_( tracked_object ), names_( names ), extracted_( names.size() ), masks_( names.size() )
+    {
+      ROS_ASSERT( names_.size() <= colorPlaneTypeBits( plane_.type() ) );
+      
+      for( unsigned int bit = 0; bit < names_.size(); ++bit )
+	bits_[ names_[ bit ] ] = bit;
+    }
+
+    const_iterator begin() const { return names_.begin(); }
+    const_iterator end() const { return names_.end(); }
+    size_t size() const { return names_.size(); }
+    bool empty() const { return names_.empty(); }
+    size_t count( std::string const & name ) const { return bits_.count( name ); }
+    
+    int rows() const { return plane_.rows; }
+    int cols() const { return plane_.cols; }
+    
+    /// The undecoded plane, with bit i set where color i is present
+    cv::Mat const & plane() const { return plane_; }
+
+    /** 
+     * Get the mask for a color, extracting it if this is the first access.
+     * 
+     * @param name Name of the color
+     * 
+     * @return CV_8UC1 image that is 255 where the color is present and 0 elsewhere. Must not be modified.
+     * Throws std::out_of_range if there is no such color.
+     */
+    cv::Mat const & at( std::string const & name ) const
+    {
+      unsigned int const bit = bits_.at( name );
+
+      std::call_once( extracted_[ bit ], [this, bit]() { extractColorBit( plane_, bit, masks_[ bit ] ); } );
+      
+      return masks_[ bit ];
+    }
+  };
 
-  typedef std::map<std::string, cv::Mat> ColorImageMap;
   typedef std::shared_ptr<ColorImageMap> ColorImageMapPtr;
   typedef std::shared_ptr<ColorImageMap const> ColorImageMapConstPtr;
   
+  /**
+   * Packs one mask per color into a single color plane (see color_plane.h) with one bit per color.
+   * A plane of plane_bits bits holds up to plane_bits colors.
+   */
   class ColorEncoder
   {
   private:
-    cv::Mat image_;
+    cv::Mat image_, mask_;
     std::vector<std::string> names_;
     unsigned int color_idx_;
+    unsigned int plane_bits_;
     
   public:
-  ColorEncoder(): color_idx_(0){}
+  ColorEncoder( unsigned int const plane_bits = 16 ): color_idx_(0), plane_bits_( plane_bits )
+    {
+      ROS_ASSERT( colorPlaneType( plane_bits_ ) >= 0 );
+    }
 
-    void addImage( cv::Mat const & input, std::string const & name)
+    unsigned int planeBits() const { return plane_bits_; }
+
+    /** 
+     * Change the width of the plane. This removes all colors.
+     * 
+     * @param plane_bits 16, 32 or 64
+     */
+    void setPlaneBits( unsigned int const plane_bits )
     {
-      /// Using 1 bit per color at a depth of 16 bits limits us to 16 colors
-      ROS_ASSERT( color_idx_ < 16 );
+      ROS_ASSERT( colorPlaneType( plane_bits ) >= 0 );
       
-      if( image_.empty())
+      plane_bits_ = plane_bits;
+      image_ = cv::Mat();
+      clear();
+    }
+
+    void addImage( cv::Mat const & input, std::string const & name)
+    {
+      /// One bit per color
+      ROS_ASSERT( color_idx_ < plane_bits_ );
+
+      int const plane_type = colorPlaneType( plane_bits_ );
+      if( image_.empty() || image_.size() != input.size() || image_.type() != plane_type )
 	{
-	  image_ = cv::Mat( input.size(), cv_bridge::getCvType( COLOR_CODEC_IMAGE_TYPE ));
+	  image_ = cv::Mat( input.size(), plane_type );
 	  image_.setTo(0);
 	}
-      cv::Mat encoded; input.copyTo(encoded); 
-      /// convert to mono16 before encoding so that mono8 images don't clip when image count exceeds 8
-      encoded.convertTo(encoded, CV_8UC1);
-      /// Set the pixels where encoded is non-zero to 2^color_idx
-      cv::add(image_, (1 << color_idx_), image_, encoded);
+      /// Mono8 inputs are used as-is, everything else is converted into a reused buffer.
+      cv::Mat encoded = input;
+      if( input.type() != CV_8UC1 )
+	{
+	  input.convertTo(mask_, CV_8UC1);
+	  encoded = mask_;
+	}
+      /// Set bit color_idx in the pixels where encoded is non-zero
+      orColorBit( encoded, color_idx_, image_ );
       names_.push_back(name);
       ++color_idx_;
     }
 
+    /** 
+     * Add a composite of colors that have already been added, without another image.
+     * 
+     * @param source_bits Bits of the colors that make up the composite, i.e. 1 << (index in which they were added)
+     * @param name Name of the composite
+     */
+    void addComposite( uint64_t const source_bits, std::string const & name )
+    {
+      ROS_ASSERT( color_idx_ < plane_bits_ && !image_.empty() );
+      ROS_ASSERT( !( source_bits >> color_idx_ ) );
+
+      orCompositeBit( image_, source_bits, color_idx_ );
+      names_.push_back(name);
+      ++color_idx_;
+    }
+
+    /** 
+     * Remove all colors. The image buffer is kept, so an encoder can be reused between frames without reallocating.
+     */
+    void clear()
+    {
+      if( !image_.empty() )
+	image_.setTo(0);
+      names_.clear();
+      color_idx_ = 0;
+    }
+
+    /** 
+     * Use an image that is already encoded, e.g. by a classifier that produces every color at once,
+     * instead of adding colors one at a time. The image is not copied.
+     * 
+     * @param encoded Color plane of any width, with bit i set where color i is present
+     * @param names Name of each color, in bit order
+     */
+    void setImage( cv::Mat const & encoded, std::vector<std::string> const & names )
+    {
+      plane_bits_ = colorPlaneTypeBits( encoded.type() );
+      ROS_ASSERT( plane_bits_ && names.size() <= plane_bits_ );
+
+      image_ = encoded;
+      names_ = names;
+      color_idx_ = names.size();
+    }
+
     friend class EncodedColorPublisher;
   };
   
@@ -94,21 +242,60 @@ namespace uscauv
   {
   private:
     ros::Publisher pub_;
+    bool compress_;
+    /// Size of the last published plane, uncompressed and as sent
+    size_t raw_bytes_, sent_bytes_;
 
   public:
+  EncodedColorPublisher(): compress_( false ), raw_bytes_( 0 ), sent_bytes_( 0 ) {}
+    
     void advertise( ros::NodeHandle nh, std::string const & topic, int const & queue_size = 1)
     {
       pub_ = nh.advertise<auv_msgs::ColorEncodedImage>(topic, queue_size );
     }
+
+    /// Run-length encode planes before publishing them. Planes that wouldn't get smaller are still sent raw.
+    void setCompression( bool const compress ) { compress_ = compress; }
+
+    size_t lastRawBytes() const { return raw_bytes_; }
+    size_t lastSentBytes() const { return sent_bytes_; }
     
     void publish( ColorEncoder const & encoder,  std_msgs::Header const & header)
     {
       auv_msgs::ColorEncodedImage msg;
-      cv_bridge::CvImage image_out(header, COLOR_CODEC_IMAGE_TYPE, encoder.image_ );
-      image_out.toImageMsg(msg.image);
       msg.encoding = encoder.names_;
-      pub_.publish( msg );
+      msg.plane_bits = encoder.plane_bits_;
+      
+      cv::Mat const & plane = encoder.image_;
+      raw_bytes_ = plane.total() * plane.elemSize();
 
+      if( compress_ )
+	{
+	  encodeColorPlaneRLE( plane, msg.compressed );
+	  
+	  if( msg.compressed.size() < raw_bytes_ )
+	    {
+	      msg.compression = auv_msgs::ColorEncodedImage::COMPRESSION_RLE;
+	      msg.image.header = header;
+	      msg.image.height = plane.rows;
+	      msg.image.width = plane.cols;
+	      msg.image.encoding = colorPlaneEncoding( encoder.plane_bits_ );
+	      msg.image.is_bigendian = false;
+	      msg.image.step = plane.cols * plane.elemSize();
+	      
+	      sent_bytes_ = msg.compressed.size();
+	      pub_.publish( msg );
+	      return;
+	    }
+	  msg.compressed.clear();
+	}
+      
+      cv_bridge::CvImage image_out(header, colorPlaneEncoding( encoder.plane_bits_ ), plane );
+      image_out.toImageMsg(msg.image);
+      msg.compression = auv_msgs::ColorEncodedImage::COMPRESSION_NONE;
+      
+      sent_bytes_ = raw_bytes_;
+      pub_.publish( msg );
     }
     
   };
@@ -133,18 +320,36 @@ namespace uscauv
   private:
     void decode( auv_msgs::ColorEncodedImage::ConstPtr const & msg)
     {
-      ColorImageMapPtr decoded = std::make_shared<ColorImageMap>();
-      
-      unsigned int color_idx = 0;
-      for(std::vector<std::string>::const_iterator name_it = msg->encoding.begin();
-	  name_it != msg->encoding.end(); ++name_it, ++color_idx)
+      /// Older publishers don't set the plane width
+      unsigned int const plane_bits = msg->plane_bits ? msg->plane_bits : 16;
+      if( colorPlaneType( plane_bits ) < 0 || msg->encoding.size() > plane_bits )
+	{
+	  ROS_WARN( "Received encoded image with [ %lu ] colors in a [ %u ] bit plane. Dropping...", msg->encoding.size(), plane_bits );
+	  return;
+	}
+
+      ColorImageMapPtr decoded;
+
+      if( msg->compression == auv_msgs::ColorEncodedImage::COMPRESSION_RLE )
+	{
+	  cv::Mat plane;
+	  if( decodeColorPlaneRLE( msg->compressed, msg->image.height, msg->image.width, plane_bits, plane ) )
+	    {
+	      ROS_WARN( "Received malformed run-length encoded image. Dropping..." );
+	      return;
+	    }
+	  decoded = std::make_shared<ColorImageMap>( plane, msg->encoding );
+	}
+      else if( msg->compression == auv_msgs::ColorEncodedImage::COMPRESSION_NONE )
+	{
+	  /// No copy. The CvImage holds on to the message, and the map holds on to the CvImage.
+	  cv_bridge::CvImageConstPtr const plane = cv_bridge::toCvShare( msg->image, msg, colorPlaneEncoding( plane_bits ) );
+	  decoded = std::make_shared<ColorImageMap>( plane->image, msg->encoding, plane );
+	}
+      else
 	{
-	  cv::Mat output = cv_bridge::toCvCopy( msg->image, COLOR_CODEC_IMAGE_TYPE )->image;
-	  cv::bitwise_and(output, (1 << color_idx) , output);
-	  /* ROS_DEBUG("Decoding with key %d", (1 << color_idx)); */
-	  output.convertTo( output, CV_8UC1 );
-	  output.setTo( 255, output );
-	  decoded->insert( std::pair<std::string, cv::Mat>( *name_it, output ));
+	  ROS_WARN( "Received encoded image with unknown compression [ %u ]. Dropping...", msg->compression );
+	  return;
 	}
       
       if( external_callback )
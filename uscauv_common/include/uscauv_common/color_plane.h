@@ -0,0 +1,381 @@
+/***************************************************************************
+ *  include/uscauv_common/color_plane.h
+ *  --------------------
+ *
+ *  Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_USCAUVCOMMON_COLORPLANE
+#define USCAUV_USCAUVCOMMON_COLORPLANE
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+// cpp11
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+namespace uscauv
+{
+  /**
+   * Color planes pack one bit per color into each pixel. Planes are 16, 32 or 64 bits wide and are stored as
+   * CV_16UC1, CV_32SC1 and CV_32SC2 images respectively. The 64-bit plane treats the two channels of each
+   * pixel as a single native-endian 64-bit word.
+   */
+  static unsigned int const COLOR_PLANE_MAX_BITS = 64;
+  
+  /// Narrowest plane that can hold color_count colors, or 0 if there are too many
+  inline unsigned int colorPlaneBits( size_t const color_count )
+  {
+    return color_count <= 16 ? 16 : color_count <= 32 ? 32 : color_count <= 64 ? 64 : 0;
+  }
+
+  /// OpenCV type of a plane, or -1 if plane_bits isn't a supported width
+  inline int colorPlaneType( unsigned int const plane_bits )
+  {
+    switch( plane_bits )
+      {
+      case 16: return CV_16UC1;
+      case 32: return CV_32SC1;
+      case 64: return CV_32SC2;
+      default: return -1;
+      }
+  }
+
+  /// Width of a plane with the given OpenCV type, or 0 if it isn't a plane type
+  inline unsigned int colorPlaneTypeBits( int const type )
+  {
+    switch( type )
+      {
+      case CV_16UC1: return 16;
+      case CV_32SC1: return 32;
+      case CV_32SC2: return 64;
+      default: return 0;
+      }
+  }
+
+  /// sensor_msgs image encoding of a plane
+  inline char const * colorPlaneEncoding( unsigned int const plane_bits )
+  {
+    return plane_bits == 64 ? "32SC2" : plane_bits == 32 ? "32SC1" : "mono16";
+  }
+
+  template<class Word>
+    void orColorBitImpl( cv::Mat const & mask, unsigned int const bit, cv::Mat & plane )
+    {
+      int const cols = plane.cols;
+      for( int row = 0; row < plane.rows; ++row )
+	{
+	  unsigned char const * in = mask.ptr<unsigned char>( row );
+	  Word * px = plane.ptr<Word>( row );
+	  
+	  for( int col = 0; col < cols; ++col )
+	    px[ col ] |= Word( in[ col ] != 0 ) << bit;
+	}
+    }
+
+  /** 
+   * Set a color's bit in every pixel of a plane where its mask is non-zero, in a single pass.
+   * 
+   * @param mask CV_8UC1 mask of the same size as the plane
+   * @param bit Index of the color
+   * @param plane Color plane
+   */
+  inline void orColorBit( cv::Mat const & mask, unsigned int const bit, cv::Mat & plane )
+  {
+    unsigned int const plane_bits = colorPlaneTypeBits( plane.type() );
+    CV_Assert( mask.type() == CV_8UC1 && mask.size() == plane.size() && bit < plane_bits );
+
+    switch( plane_bits )
+      {
+      case 16: orColorBitImpl<uint16_t>( mask, bit, plane ); break;
+      case 32: orColorBitImpl<uint32_t>( mask, bit, plane ); break;
+      case 64: orColorBitImpl<uint64_t>( mask, bit, plane ); break;
+      }
+  }
+  
+  template<class Word>
+    void extractColorBitImpl( cv::Mat const & plane, unsigned int const bit, cv::Mat & output )
+    {
+      int const cols = plane.cols;
+      for( int row = 0; row < plane.rows; ++row )
+	{
+	  Word const * in = plane.ptr<Word>( row );
+	  unsigned char * out = output.ptr<unsigned char>( row );
+	  
+	  for( int col = 0; col < cols; ++col )
+	    out[ col ] = -static_cast<unsigned char>( ( in[ col ] >> bit ) & 1 );
+	}
+    }
+
+  /** 
+   * Extract the mask for a single color from a plane.
+   * 
+   * @param plane Color plane
+   * @param bit Index of the color
+   * @param output CV_8UC1 image that is 255 where the color is present and 0 elsewhere.
+   * Reallocated only if its size or type is wrong.
+   */
+  inline void extractColorBit( cv::Mat const & plane, unsigned int const bit, cv::Mat & output )
+  {
+    unsigned int const plane_bits = colorPlaneTypeBits( plane.type() );
+    CV_Assert( bit < plane_bits );
+
+    output.create( plane.size(), CV_8UC1 );
+    
+    switch( plane_bits )
+      {
+      case 16: extractColorBitImpl<uint16_t>( plane, bit, output ); break;
+      case 32: extractColorBitImpl<uint32_t>( plane, bit, output ); break;
+      case 64: extractColorBitImpl<uint64_t>( plane, bit, output ); break;
+      }
+  }
+
+  template<class Word>
+    void colorPlaneMaskImpl( cv::Mat const & plane, cv::Mat & output )
+    {
+      int const cols = plane.cols;
+      for( int row = 0; row < plane.rows; ++row )
+	{
+	  Word const * in = plane.ptr<Word>( row );
+	  unsigned char * out = output.ptr<unsigned char>( row );
+	  
+	  for( int col = 0; col < cols; ++col )
+	    out[ col ] = -static_cast<unsigned char>( in[ col ] != 0 );
+	}
+    }
+
+  /** 
+   * Find the pixels of a plane where any color is present.
+   * 
+   * @param plane Color plane
+   * @param output CV_8UC1 image that is 255 where any bit is set and 0 elsewhere.
+   * Reallocated only if its size or type is wrong.
+   */
+  inline void colorPlaneMask( cv::Mat const & plane, cv::Mat & output )
+  {
+    unsigned int const plane_bits = colorPlaneTypeBits( plane.type() );
+    CV_Assert( plane_bits );
+
+    output.create( plane.size(), CV_8UC1 );
+    
+    switch( plane_bits )
+      {
+      case 16: colorPlaneMaskImpl<uint16_t>( plane, output ); break;
+      case 32: colorPlaneMaskImpl<uint32_t>( plane, output ); break;
+      case 64: colorPlaneMaskImpl<uint64_t>( plane, output ); break;
+      }
+  }
+
+  template<class Word>
+    void orCompositeBitImpl( cv::Mat & plane, Word const source_bits, unsigned int const composite_bit )
+    {
+      int const cols = plane.cols;
+      for( int row = 0; row < plane.rows; ++row )
+	{
+	  Word * px = plane.ptr<Word>( row );
+	  
+	  for( int col = 0; col < cols; ++col )
+	    px[ col ] |= Word( ( px[ col ] & source_bits ) != 0 ) << composite_bit;
+	}
+    }
+  
+  /** 
+   * Set a composite color's bit in every pixel of a plane that has any of the composite's source bits set.
+   * This works on classified images as well as on encoded lookup tables, which are also planes.
+   * 
+   * @param plane Color plane
+   * @param source_bits Bits of the colors that make up the composite
+   * @param composite_bit Index of the composite color
+   */
+  inline void orCompositeBit( cv::Mat & plane, uint64_t const source_bits, unsigned int const composite_bit )
+  {
+    unsigned int const plane_bits = colorPlaneTypeBits( plane.type() );
+    CV_Assert( composite_bit < plane_bits );
+
+    switch( plane_bits )
+      {
+      case 16: orCompositeBitImpl<uint16_t>( plane, source_bits, composite_bit ); break;
+      case 32: orCompositeBitImpl<uint32_t>( plane, source_bits, composite_bit ); break;
+      case 64: orCompositeBitImpl<uint64_t>( plane, source_bits, composite_bit ); break;
+      }
+  }
+
+  /// Append an unsigned LEB128 varint
+  inline void appendVarint( std::vector<uint8_t> & output, uint64_t value )
+  {
+    while( value >= 0x80 )
+      {
+	output.push_back( static_cast<uint8_t>( value ) | 0x80 );
+	value >>= 7;
+      }
+    output.push_back( static_cast<uint8_t>( value ) );
+  }
+
+  /** 
+   * Read an unsigned LEB128 varint.
+   * 
+   * @param data Input buffer
+   * @param size Size of the input buffer
+   * @param pos Position to read from. Advanced past the varint.
+   * @param value Output value
+   * 
+   * @return 0 on success, -1 if the varint is truncated or too long
+   */
+  inline int readVarint( uint8_t const * data, size_t const size, size_t & pos, uint64_t & value )
+  {
+    value = 0;
+    for( unsigned int shift = 0; shift < 64 && pos < size; shift += 7 )
+      {
+	uint8_t const byte = data[ pos++ ];
+	value |= uint64_t( byte & 0x7f ) << shift;
+	if( !( byte & 0x80 ) )
+	  return 0;
+      }
+    return -1;
+  }
+  
+  template<class Word>
+    void encodeColorPlaneRLEImpl( cv::Mat const & plane, std::vector<uint8_t> & output )
+    {
+      int const cols = plane.cols;
+      Word value = 0;
+      uint64_t run = 0;
+      
+      for( int row = 0; row < plane.rows; ++row )
+	{
+	  Word const * px = plane.ptr<Word>( row );
+	  
+	  for( int col = 0; col < cols; )
+	    {
+	      int const start = col;
+	      while( col < cols && px[ col ] == value )
+		++col;
+	      run += col - start;
+	      
+	      if( col < cols )
+		{
+		  if( run )
+		    {
+		      appendVarint( output, run );
+		      appendVarint( output, value );
+		    }
+		  value = px[ col ];
+		  run = 0;
+		}
+	    }
+	}
+      
+      if( run )
+	{
+	  appendVarint( output, run );
+	  appendVarint( output, value );
+	}
+    }
+
+  /** 
+   * Run-length encode a color plane. The pixels are read in raster order and stored as (run length, value)
+   * pairs of varints, so a plane that is mostly 0 compresses to a few bytes per transition.
+   * 
+   * @param plane Color plane
+   * @param output Encoded bytes. Cleared first, but its capacity is reused.
+   */
+  inline void encodeColorPlaneRLE( cv::Mat const & plane, std::vector<uint8_t> & output )
+  {
+    unsigned int const plane_bits = colorPlaneTypeBits( plane.type() );
+    CV_Assert( plane_bits );
+
+    output.clear();
+    
+    switch( plane_bits )
+      {
+      case 16: encodeColorPlaneRLEImpl<uint16_t>( plane, output ); break;
+      case 32: encodeColorPlaneRLEImpl<uint32_t>( plane, output ); break;
+      case 64: encodeColorPlaneRLEImpl<uint64_t>( plane, output ); break;
+      }
+  }
+
+  template<class Word>
+    int decodeColorPlaneRLEImpl( std::vector<uint8_t> const & input, cv::Mat & plane )
+    {
+      Word * out = plane.ptr<Word>( 0 );
+      uint64_t const total = plane.total();
+      uint64_t filled = 0, run, value;
+      
+      for( size_t pos = 0; pos < input.size(); )
+	{
+	  if( readVarint( &input[0], input.size(), pos, run ) || readVarint( &input[0], input.size(), pos, value ) ||
+	      run > total - filled )
+	    return -1;
+	  
+	  std::fill( out + filled, out + filled + run, static_cast<Word>( value ) );
+	  filled += run;
+	}
+      
+      return filled == total ? 0 : -1;
+    }
+
+  /** 
+   * Decode a color plane encoded by encodeColorPlaneRLE().
+   * 
+   * @param input Encoded bytes
+   * @param rows Height of the plane
+   * @param cols Width of the plane
+   * @param plane_bits Width of the plane's pixels
+   * @param plane Output plane. Reallocated only if its size or type is wrong.
+   * 
+   * @return 0 on success, -1 if the input is malformed or doesn't cover exactly rows * cols pixels
+   */
+  inline int decodeColorPlaneRLE( std::vector<uint8_t> const & input, int const rows, int const cols,
+				  unsigned int const plane_bits, cv::Mat & plane )
+  {
+    int const type = colorPlaneType( plane_bits );
+    if( type < 0 || rows < 0 || cols < 0 )
+      return -1;
+
+    plane.create( rows, cols, type );
+    CV_Assert( plane.isContinuous() );
+
+    switch( plane_bits )
+      {
+      case 16: return decodeColorPlaneRLEImpl<uint16_t>( input, plane );
+      case 32: return decodeColorPlaneRLEImpl<uint32_t>( input, plane );
+      default: return decodeColorPlaneRLEImpl<uint64_t>( input, plane );
+      }
+  }
+
+} // uscauv
+
+#endif // USCAUV_USCAUVCOMMON_COLORPLANE
@@ -201,6 +201,24 @@ class ImageTransceiver
     return;
   }
 
+  /** 
+   * Number of subscribers to an image publisher, so that callers can skip rendering
+   * images that nobody will receive.
+   * 
+   * @param topic_rel Topic name, relative to node namespace
+   * @return Subscriber count, or 0 if the topic has not been advertised
+   */
+  uint32_t getNumSubscribers( std::string const & topic_rel ) const
+  {
+    std::string const & topic_resolved = nh_rel_.resolveName( topic_rel, true);
+
+    _NamedPublisherMap::const_iterator pub_it = publishers_.find( topic_resolved );
+
+    if ( pub_it == publishers_.end() )
+      return 0;
+
+    return pub_it->second.getNumSubscribers();
+  }
   
   void publishImage(std::string const & topic_rel, sensor_msgs::ImagePtr const & image ) const
   {
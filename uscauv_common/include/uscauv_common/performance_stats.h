@@ -0,0 +1,109 @@
+/***************************************************************************
+ *  include/uscauv_common/performance_stats.h
+ *  --------------------
+ *
+ *  Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_USCAUVCOMMON_PERFORMANCESTATS
+#define USCAUV_USCAUVCOMMON_PERFORMANCESTATS
+
+// ROS
+#include <ros/ros.h>
+
+// messages
+#include <auv_msgs/PerformanceStats.h>
+
+namespace uscauv
+{
+  
+  /**
+   * Publishes named performance counters (latencies, drop counts, hit rates, etc.) as an
+   * auv_msgs::PerformanceStats message. Values persist between publishes until they are set again.
+   */
+  class PerformanceStatsPublisher
+  {
+  private:
+    ros::Publisher pub_;
+    auv_msgs::PerformanceStats msg_;
+    
+  public:
+    void advertise( ros::NodeHandle nh, std::string const & topic, int const & queue_size = 1 )
+    {
+      pub_ = nh.advertise<auv_msgs::PerformanceStats>( topic, queue_size );
+    }
+
+    /** 
+     * Set the value of a named counter. Counters are published in the order in which they were first set.
+     */
+    void set( std::string const & name, double const & value )
+    {
+      for( size_t idx = 0; idx < msg_.names.size(); ++idx )
+	{
+	  if( msg_.names[ idx ] == name )
+	    {
+	      msg_.values[ idx ] = value;
+	      return;
+	    }
+	}
+      
+      msg_.names.push_back( name );
+      msg_.values.push_back( value );
+    }
+
+    /// Get the value of a named counter, or 0 if it has never been set
+    double get( std::string const & name ) const
+    {
+      for( size_t idx = 0; idx < msg_.names.size(); ++idx )
+	{
+	  if( msg_.names[ idx ] == name )
+	    return msg_.values[ idx ];
+	}
+      return 0;
+    }
+
+    /// Only publishes if someone is listening
+    void publish( std_msgs::Header const & header )
+    {
+      if( !pub_ || !pub_.getNumSubscribers() )
+	return;
+      
+      msg_.header = header;
+      pub_.publish( msg_ );
+    }
+  };
+
+} // uscauv
+
+#endif // USCAUV_USCAUVCOMMON_PERFORMANCESTATS
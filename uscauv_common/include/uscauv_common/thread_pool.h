@@ -0,0 +1,255 @@
+/***************************************************************************
+ *  include/uscauv_common/thread_pool.h
+ *  --------------------
+ *
+ *  Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2014, Dylan Foster
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of USC AUV nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+
+
+#ifndef USCAUV_USCAUVCOMMON_THREADPOOL
+#define USCAUV_USCAUVCOMMON_THREADPOOL
+
+/// cpp11
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <vector>
+
+namespace uscauv
+{
+
+  /**
+   * Fixed-size pool of worker threads for data-parallel work. Each call to run() splits a batch
+   * of work items evenly between per-thread queues. A thread that empties its own queue steals
+   * items from the back of the other queues, so uneven items still balance out. The calling
+   * thread works on the batch too, so a pool of size n starts n-1 threads.
+   *
+   * Doesn't depend on ROS so that it can be used in offline tools.
+   */
+  class ThreadPool
+  {
+  public:
+    typedef std::function<void( size_t )> Task;
+    
+  private:
+    struct WorkQueue
+    {
+      std::mutex m_;
+      std::deque<size_t> items_;
+    };
+    
+    std::vector<std::thread> workers_;
+    /// One queue per worker, plus one for the thread that calls run()
+    std::vector<std::unique_ptr<WorkQueue> > queues_;
+
+    /// Guards everything below it
+    std::mutex state_mutex_;
+    std::condition_variable work_cv_, done_cv_;
+    Task const * task_;
+    size_t remaining_;
+    unsigned int active_;
+    unsigned long batch_;
+    bool stopping_;
+
+    /// Only one batch runs at a time
+    std::mutex run_mutex_;
+    
+  public:
+    /** 
+     * @param threads Number of threads that work on each batch, including the caller. If 0, use one per hardware thread.
+     */
+    explicit ThreadPool( unsigned int threads = 0 ):
+      task_( NULL ), remaining_( 0 ), active_( 0 ), batch_( 0 ), stopping_( false )
+    {
+      if( !threads )
+	threads = std::thread::hardware_concurrency();
+      if( !threads )
+	threads = 1;
+
+      for( unsigned int idx = 0; idx < threads; ++idx )
+	queues_.push_back( std::unique_ptr<WorkQueue>( new WorkQueue ) );
+      
+      for( unsigned int idx = 0; idx + 1 < threads; ++idx )
+	workers_.push_back( std::thread( &ThreadPool::workerThread, this, idx ) );
+    }
+
+    ~ThreadPool()
+    {
+      {
+	std::lock_guard<std::mutex> lock( state_mutex_ );
+	stopping_ = true;
+      }
+      work_cv_.notify_all();
+
+      for( std::thread & worker : workers_ )
+	worker.join();
+    }
+
+    ThreadPool( ThreadPool const & ) = delete;
+    ThreadPool & operator=( ThreadPool const & ) = delete;
+
+    /// Number of threads that work on each batch, including the caller
+    unsigned int size() const { return queues_.size(); }
+    
+    /** 
+     * Call task(idx) for every idx in [0, count) and block until all calls have returned.
+     * Calls are distributed between the threads in the pool, so task must be safe to call concurrently.
+     * 
+     * @param count Number of work items in the batch
+     * @param task Function to call on each work item
+     */
+    void run( size_t const count, Task const & task )
+    {
+      std::lock_guard<std::mutex> run_lock( run_mutex_ );
+      
+      if( !count )
+	return;
+      
+      size_t const queue_count = queues_.size();
+
+      /// Give each queue a contiguous block of items so that neighbouring items tend to run on the same thread
+      for( size_t queue = 0; queue < queue_count; ++queue )
+	{
+	  WorkQueue & work_queue = *queues_[ queue ];
+	  std::lock_guard<std::mutex> lock( work_queue.m_ );
+	  for( size_t item = count * queue / queue_count; item < count * (queue + 1) / queue_count; ++item )
+	    work_queue.items_.push_back( item );
+	}
+      
+      {
+	std::lock_guard<std::mutex> lock( state_mutex_ );
+	task_ = &task;
+	remaining_ = count;
+	++batch_;
+      }
+      work_cv_.notify_all();
+      
+      size_t const done = drain( queue_count - 1, task );
+
+      /// Wait for the items owned by other threads, and for any thread that may still be looking for work to give up
+      std::unique_lock<std::mutex> lock( state_mutex_ );
+      remaining_ -= done;
+      done_cv_.wait( lock, [this]{ return !remaining_ && !active_; } );
+      task_ = NULL;
+    }
+
+  private:
+    bool pop( size_t const queue, size_t & item )
+    {
+      WorkQueue & work_queue = *queues_[ queue ];
+      std::lock_guard<std::mutex> lock( work_queue.m_ );
+      
+      if( work_queue.items_.empty() )
+	return false;
+
+      item = work_queue.items_.front();
+      work_queue.items_.pop_front();
+      return true;
+    }
+
+    bool steal( size_t const thief, size_t & item )
+    {
+      size_t const queue_count = queues_.size();
+      
+      for( size_t offset = 1; offset < queue_count; ++offset )
+	{
+	  WorkQueue & work_queue = *queues_[ (thief + offset) % queue_count ];
+	  std::lock_guard<std::mutex> lock( work_queue.m_ );
+	  
+	  if( work_queue.items_.empty() )
+	    continue;
+	  
+	  item = work_queue.items_.back();
+	  work_queue.items_.pop_back();
+	  return true;
+	}
+      return false;
+    }
+
+    /// Run items from our own queue, then from everyone else's, until there are none left. Returns the number of items run.
+    size_t drain( size_t const queue, Task const & task )
+    {
+      size_t done = 0, item;
+      
+      while( pop( queue, item ) || steal( queue, item ) )
+	{
+	  task( item );
+	  ++done;
+	}
+      return done;
+    }
+    
+    void workerThread( size_t const queue )
+    {
+      unsigned long batch = 0;
+      
+      while( true )
+	{
+	  Task const * task;
+	  
+	  {
+	    std::unique_lock<std::mutex> lock( state_mutex_ );
+	    work_cv_.wait( lock, [&]{ return stopping_ || batch_ != batch; } );
+
+	    if( stopping_ )
+	      return;
+
+	    batch = batch_;
+	    /// We woke up after the batch already finished
+	    if( !task_ )
+	      continue;
+	    
+	    task = task_;
+	    ++active_;
+	  }
+
+	  size_t const done = drain( queue, *task );
+	  
+	  {
+	    std::lock_guard<std::mutex> lock( state_mutex_ );
+	    remaining_ -= done;
+	    --active_;
+	    if( !remaining_ && !active_ )
+	      done_cv_.notify_all();
+	  }
+	}
+    }
+    
+  };
+  
+} // uscauv
+
+#endif // USCAUV_USCAUVCOMMON_THREADPOOL